@@ -0,0 +1,248 @@
+#include "KettleProtocol.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHA256BLOCK              64
+
+static const uint32_t SHA256K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+struct Sha256  {
+  uint32_t state[8];
+  uint8_t block[SHA256BLOCK];
+  size_t blockLength;
+  uint64_t totalLength;
+};
+
+static uint32_t rotateRight(uint32_t value, int bits)
+{
+  return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256Block(Sha256 &hash)
+{
+  uint32_t w[64];
+  for(int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)hash.block[i * 4] << 24 | (uint32_t)hash.block[i * 4 + 1] << 16 |
+           (uint32_t)hash.block[i * 4 + 2] << 8 | hash.block[i * 4 + 3];
+  }
+  for(int i = 16; i < 64; i++) {
+    uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = hash.state[0], b = hash.state[1], c = hash.state[2], d = hash.state[3];
+  uint32_t e = hash.state[4], f = hash.state[5], g = hash.state[6], h = hash.state[7];
+
+  for(int i = 0; i < 64; i++) {
+    uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+    uint32_t choose = (e & f) ^ (~e & g);
+    uint32_t temp1 = h + s1 + choose + SHA256K[i] + w[i];
+    uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+    uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+    uint32_t temp2 = s0 + majority;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + temp1;
+    d = c;
+    c = b;
+    b = a;
+    a = temp1 + temp2;
+  }
+
+  hash.state[0] += a; hash.state[1] += b; hash.state[2] += c; hash.state[3] += d;
+  hash.state[4] += e; hash.state[5] += f; hash.state[6] += g; hash.state[7] += h;
+}
+
+static void sha256Start(Sha256 &hash)
+{
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(hash.state, initial, sizeof(initial));
+  hash.blockLength = 0;
+  hash.totalLength = 0;
+}
+
+static void sha256Update(Sha256 &hash, const uint8_t* data, size_t length)
+{
+  hash.totalLength += length;
+  while(length--) {
+    hash.block[hash.blockLength++] = *data++;
+    if(hash.blockLength == SHA256BLOCK) {
+      sha256Block(hash);
+      hash.blockLength = 0;
+    }
+  }
+}
+
+static void sha256Finish(Sha256 &hash, uint8_t out[32])
+{
+  uint64_t bits = hash.totalLength * 8;
+  uint8_t padding = 0x80;
+  sha256Update(hash, &padding, 1);
+  padding = 0;
+  while(hash.blockLength != SHA256BLOCK - 8) sha256Update(hash, &padding, 1);
+
+  for(int i = 7; i >= 0; i--) {
+    hash.block[hash.blockLength++] = bits >> (i * 8);
+  }
+  sha256Block(hash);
+
+  for(int i = 0; i < 8; i++) {
+    out[i * 4] = hash.state[i] >> 24;
+    out[i * 4 + 1] = hash.state[i] >> 16;
+    out[i * 4 + 2] = hash.state[i] >> 8;
+    out[i * 4 + 3] = hash.state[i];
+  }
+}
+
+void sha256(const uint8_t* data, size_t length, uint8_t out[32])
+{
+  Sha256 hash;
+  sha256Start(hash);
+  sha256Update(hash, data, length);
+  sha256Finish(hash, out);
+}
+
+void hmacSha256(const uint8_t* key, size_t keyLength, const uint8_t* message, size_t length, uint8_t out[HMACSIZE])
+{
+  uint8_t keyBlock[SHA256BLOCK] = {0};
+  if(keyLength > SHA256BLOCK) sha256(key, keyLength, keyBlock);
+  else memcpy(keyBlock, key, keyLength);
+
+  uint8_t pad[SHA256BLOCK];
+  uint8_t inner[32];
+  Sha256 hash;
+
+  for(int i = 0; i < SHA256BLOCK; i++) pad[i] = keyBlock[i] ^ 0x36;
+  sha256Start(hash);
+  sha256Update(hash, pad, SHA256BLOCK);
+  sha256Update(hash, message, length);
+  sha256Finish(hash, inner);
+
+  for(int i = 0; i < SHA256BLOCK; i++) pad[i] = keyBlock[i] ^ 0x5c;
+  sha256Start(hash);
+  sha256Update(hash, pad, SHA256BLOCK);
+  sha256Update(hash, inner, sizeof(inner));
+  sha256Finish(hash, out);
+}
+
+void hmacHex(const uint8_t* key, const char* message, size_t length, char out[HMACHEXSIZE + 1])
+{
+  uint8_t mac[HMACSIZE];
+  hmacSha256(key, HMACSIZE, (const uint8_t*)message, length, mac);
+  for(int i = 0; i < HMACSIZE; i++) sprintf(out + i * 2, "%02x", mac[i]);
+}
+
+bool hmacMatches(const uint8_t* key, const char* message, size_t length, const char* hexMac)
+{
+  if(strlen(hexMac) != HMACHEXSIZE) return false;
+
+  char expected[HMACHEXSIZE + 1];
+  hmacHex(key, message, length, expected);
+
+  uint8_t difference = 0;
+  for(int i = 0; i < HMACHEXSIZE; i++) difference |= expected[i] ^ hexMac[i];
+  return difference == 0;
+}
+
+bool hexToBytes(const char* hex, uint8_t* bytes, size_t length)
+{
+  for(size_t i = 0; i < length; i++) {
+    if(!isxdigit((unsigned char)hex[i * 2]) || !isxdigit((unsigned char)hex[i * 2 + 1])) return false;
+    char pair[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+    bytes[i] = strtoul(pair, NULL, 16);
+  }
+  return hex[length * 2] == '\0';
+}
+
+size_t requestIdLength(const char* command)
+{
+  size_t length = 0;
+  while(isdigit((unsigned char)command[length]) && length <= MAXREQUESTID) length++;
+
+  if(length == 0 || length > MAXREQUESTID || command[length] != ':') return 0;
+  return length;
+}
+
+bool parseCounter(const char* digits, size_t length, uint64_t &counter)
+{
+  counter = 0;
+  for(size_t i = 0; i < length; i++) {
+    uint64_t digit = digits[i] - '0';
+    if(counter > (UINT64_MAX - digit) / 10) return false;
+    counter = counter * 10 + digit;
+  }
+  return true;
+}
+
+UdpVerdict udpVerify(char* packet, const uint8_t* key, uint64_t lastCounter, uint64_t &counter)
+{
+  counter = 0;
+
+  char* mac = strrchr(packet, '|');
+  if(!mac) return UDP_UNSIGNED;
+  *mac = '\0';
+  mac++;
+
+  if(!hmacMatches(key, packet, strlen(packet), mac)) return UDP_FORGED;
+
+  size_t idLength = requestIdLength(packet);
+  if(!idLength || !parseCounter(packet, idLength, counter)) return UDP_MALFORMED;
+  if(counter <= lastCounter) return UDP_REPLAY;
+
+  return UDP_ACCEPT;
+}
+
+char* counterWrite(char* out, uint64_t counter)
+{
+  char digits[MAXREQUESTID];
+  int length = 0;
+  do {
+    digits[length++] = '0' + counter % 10;
+    counter /= 10;
+  } while(counter);
+
+  while(length) *out++ = digits[--length];
+  *out = '\0';
+  return out;
+}
+
+bool udpReply(UdpVerdict verdict, uint64_t counter, uint64_t lastCounter, char reply[UDPREPLYSIZE + 1])
+{
+  if(verdict == UDP_MALFORMED) {
+    strcpy(reply, "ERR,0,INVALID");
+    return true;
+  }
+  if(verdict != UDP_REPLAY) return false;
+
+  strcpy(reply, "ERR,");
+  char* end = counterWrite(reply + 4, counter);
+  strcpy(end, ",REPLAY,");
+  counterWrite(end + 8, lastCounter);
+  return true;
+}
+
+bool counterAccept(CounterWindow &window, uint64_t counter)
+{
+  window.last = counter;
+  if(counter < window.reserved) return false;
+
+  window.reserved = counter > UINT64_MAX - COUNTERBLOCK ? UINT64_MAX : counter + COUNTERBLOCK;
+  return true;
+}
@@ -0,0 +1,101 @@
+#ifndef KETTLEPROTOCOL_H
+#define KETTLEPROTOCOL_H
+
+/**
+ * Parts of the kettle network protocol with no Arduino dependencies, shared by
+ * the firmware and the host programs in Kettle Gateway so both sign, check and
+ * number messages the same way
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HMACSIZE                 32
+#define HMACHEXSIZE              (HMACSIZE * 2)
+
+//  Longest request ID accepted in front of a command, enough digits for any 64 bit counter
+#define MAXREQUESTID             20
+
+//  Longest reply udpReply writes, "ERR,<counter>,REPLAY,<counter>" with two full length counters
+#define UDPREPLYSIZE             (MAXREQUESTID * 2 + 12)
+
+//  UDP counters reserved with each flash write, about 17 minutes of millisecond timestamps
+#define COUNTERBLOCK          1048576ULL
+
+//  Outcome of checking a "<counter>:<command>|<hmac>" UDP command
+enum UdpVerdict  {
+  UDP_ACCEPT,
+  UDP_UNSIGNED,
+  UDP_FORGED,
+  UDP_MALFORMED,
+  UDP_REPLAY
+};
+
+/**
+ * Highest UDP counter accepted, and the value saved in flash. Everything up to
+ * reserved is treated as used after a reboot, so flash is only written when a
+ * counter passes it rather than on every command
+ */
+struct CounterWindow  {
+  uint64_t last;
+  uint64_t reserved;
+};
+
+void sha256(const uint8_t* data, size_t length, uint8_t out[32]);
+void hmacSha256(const uint8_t* key, size_t keyLength, const uint8_t* message, size_t length, uint8_t out[HMACSIZE]);
+
+/**
+ * @brief Lower case hex HMAC-SHA256 of message with a HMACSIZE key
+ * @param out HMACHEXSIZE characters and a terminating null
+ */
+void hmacHex(const uint8_t* key, const char* message, size_t length, char out[HMACHEXSIZE + 1]);
+
+//  Compares every character so the time taken does not leak how much matched
+bool hmacMatches(const uint8_t* key, const char* message, size_t length, const char* hexMac);
+
+bool hexToBytes(const char* hex, uint8_t* bytes, size_t length);
+
+/**
+ * @brief Length of the request ID at the start of a command, "7:SWITCH" is 1
+ * @return 0 when the command does not start with 1 to MAXREQUESTID digits and a ':'
+ */
+size_t requestIdLength(const char* command);
+
+//  Parses length decimal digits, false if they do not fit in 64 bits
+bool parseCounter(const char* digits, size_t length, uint64_t &counter);
+
+/**
+ * @brief Checks a signed UDP command in place, the '|' before the hmac is replaced by a null
+ * @param packet null terminated "<counter>:<command>|<hmac>"
+ * @param key HMACSIZE shared secret
+ * @param lastCounter highest counter accepted so far
+ * @param counter set to the packet's counter when it could be read
+ * @return UDP_ACCEPT when signed, well formed and newer than lastCounter
+ */
+UdpVerdict udpVerify(char* packet, const uint8_t* key, uint64_t lastCounter, uint64_t &counter);
+
+/**
+ * @brief The reply to a UDP command that is not run, to be signed before it is sent
+ * @param counter as udpVerify set it
+ * @param lastCounter highest counter accepted so far
+ * @param reply "ERR,0,INVALID" when malformed, "ERR,<counter>,REPLAY,<lastCounter>"
+ * for a replay, which tells the sender where to carry on from
+ * @return false when there is nothing to send: an accepted command is answered
+ * once it has run, unsigned and forged packets are dropped without a reply
+ */
+bool udpReply(UdpVerdict verdict, uint64_t counter, uint64_t lastCounter, char reply[UDPREPLYSIZE + 1]);
+
+/**
+ * @brief Writes counter in decimal, not every printf handles 64 bits
+ * @param out at least MAXREQUESTID + 1 characters
+ * @return the terminating null
+ */
+char* counterWrite(char* out, uint64_t counter);
+
+/**
+ * @brief Records an accepted counter, call after udpVerify returned UDP_ACCEPT
+ * @return true when window.reserved moved on and has to be saved before the command runs
+ */
+bool counterAccept(CounterWindow &window, uint64_t counter);
+
+#endif
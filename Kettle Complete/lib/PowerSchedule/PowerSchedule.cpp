@@ -0,0 +1,133 @@
+#include "PowerSchedule.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool beaconParse(const char* text, Beacon &beacon)
+{
+  int length = 0;
+  int fields = sscanf(text, "STATUS,%23[^,],%11[^,],%f,%f,%15[^,],%u,%u,%d,%u,%n", beacon.id, beacon.state,
+                      &beacon.temperature, &beacon.target, beacon.circuit, &beacon.cap, &beacon.watts,
+                      &beacon.priority, &beacon.secondsToTarget, &length);
+  if(fields != 9 || !length || !isdigit((unsigned char)text[length])) return false;
+
+  //  Not every scanf handles 64 bits
+  char* end;
+  errno = 0;
+  beacon.sequence = strtoull(text + length, &end, 10);
+  return *end == '\0' && errno != ERANGE;
+}
+
+bool peerUpdate(PeerTable &table, const Beacon &beacon, unsigned long now)
+{
+  Peer* peer = nullptr;
+  for(Peer &candidate : table.peers) {
+    if(candidate.id[0] && strcmp(candidate.id, beacon.id) == 0) peer = &candidate;
+  }
+  if(peer && beacon.sequence <= peer->sequence) return false;
+
+  //  A new kettle takes a slot never used if there is one, else the one expired longest ago
+  Peer* oldest = nullptr;
+  for(Peer &candidate : table.peers) {
+    if(peer || candidate.active) continue;
+    if(!candidate.id[0]) peer = &candidate;
+    else if(!oldest || now - candidate.lastSeen > now - oldest->lastSeen) oldest = &candidate;
+  }
+  if(!peer) peer = oldest;
+
+  if(!peer) {
+    //  A kettle that cannot be tracked could be heating
+    table.overflow = true;
+    table.overflowTime = now;
+    return true;
+  }
+
+  peer->active = true;
+  strcpy(peer->id, beacon.id);
+  peer->sequence = beacon.sequence;
+  peer->heating = strcmp(beacon.state, "HEATING") == 0;
+  peer->cap = beacon.cap;
+  peer->watts = beacon.watts;
+  peer->priority = beacon.priority;
+  peer->secondsToTarget = beacon.secondsToTarget;
+  peer->lastSeen = now;
+  return true;
+}
+
+void peerExpire(PeerTable &table, unsigned long now)
+{
+  for(Peer &peer : table.peers) {
+    //  Missed beacons do not stop a kettle heating, or starting to once granted,
+    //  so one heard with a demand is counted until it would have finished
+    unsigned long timeout = PEERTIMEOUT;
+    if(peer.watts) timeout += peer.secondsToTarget * 1000UL;
+    if(peer.active && now - peer.lastSeen > timeout) peer.active = false;
+  }
+  if(table.overflow && now - table.overflowTime > PEERTIMEOUT) table.overflow = false;
+}
+
+void peerClear(PeerTable &table)
+{
+  for(Peer &peer : table.peers) peer.active = false;
+  table.overflow = false;
+}
+
+bool powerScheduled(const PeerTable &table, const PowerDemand &own)
+{
+  if(table.overflow) return false;
+
+  unsigned int cap = circuitCap(table, own.cap);
+  unsigned int used = 0;
+  const Peer* waiting[MAXPEERS];
+  int waitingCount = 0;
+
+  for(const Peer &peer : table.peers) {
+    if(!peer.active || !peer.watts) continue;
+    if(peer.heating) used += peer.watts;
+    //  One that can never fit would hold up every kettle behind it for good
+    else if(peer.watts <= cap) waiting[waitingCount++] = &peer;
+  }
+
+  while(true) {
+    //  Pick the next waiting peer that is ahead of this kettle
+    const Peer* next = nullptr;
+    for(int i = 0; i < waitingCount; i++) {
+      const Peer* peer = waiting[i];
+      if(!peer) continue;
+
+      if(!scheduledBefore(peer->priority, peer->secondsToTarget, peer->id,
+                          own.priority, own.secondsToTarget, own.id)) continue;
+
+      if(!next || scheduledBefore(peer->priority, peer->secondsToTarget, peer->id,
+                                  next->priority, next->secondsToTarget, next->id)) next = peer;
+    }
+
+    if(!next) return used + own.watts <= cap;
+    if(used + next->watts > cap) return false;
+
+    used += next->watts;
+    for(int i = 0; i < waitingCount; i++) {
+      if(waiting[i] == next) waiting[i] = nullptr;
+    }
+  }
+}
+
+unsigned int circuitCap(const PeerTable &table, unsigned int ownCap)
+{
+  unsigned int cap = ownCap;
+  for(const Peer &peer : table.peers) {
+    if(peer.active && peer.cap && peer.cap < cap) cap = peer.cap;
+  }
+  return cap;
+}
+
+bool scheduledBefore(int priority, unsigned int seconds, const char* id,
+                     int otherPriority, unsigned int otherSeconds, const char* otherId)
+{
+  if(priority != otherPriority) return priority > otherPriority;
+  if(seconds != otherSeconds) return seconds < otherSeconds;
+  return strcmp(id, otherId) < 0;
+}
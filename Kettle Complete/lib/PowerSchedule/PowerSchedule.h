@@ -0,0 +1,107 @@
+#ifndef POWERSCHEDULE_H
+#define POWERSCHEDULE_H
+
+/**
+ * The power schedule kettles on one circuit agree on from each other's
+ * beacons, with no Arduino dependencies so the firmware and the simulator in
+ * Kettle Gateway run the same code
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PEERIDSIZE               24
+#define CIRCUITSIZE              16
+#define MAXPEERS                 16
+
+//  Three of the firmware's BEACONINTERVAL
+#define PEERTIMEOUT            6000
+
+/**
+ * Fields of "STATUS,<id>,<state>,<temperature>,<target>,<circuit>,<cap>,<watts>,<priority>,<seconds to target>,<sequence>".
+ * The sequence goes up with every beacon a kettle sends, across reboots too,
+ * so a recorded beacon cannot be played back as the kettle's latest
+ */
+struct Beacon  {
+  char id[PEERIDSIZE];
+  char state[12];
+  float temperature;
+  float target;
+  char circuit[CIRCUITSIZE];
+  unsigned int cap;
+  unsigned int watts;
+  int priority;
+  unsigned int secondsToTarget;
+  uint64_t sequence;
+};
+
+struct Peer  {
+  bool active;
+  char id[PEERIDSIZE];
+  uint64_t sequence;
+  bool heating;
+  unsigned int cap;
+  unsigned int watts;
+  int priority;
+  unsigned int secondsToTarget;
+  unsigned long lastSeen;
+};
+
+/**
+ * Kettles heard on this kettle's circuit. overflow is set while one of them
+ * has no room in the table, the schedule cannot be known until it clears
+ */
+struct PeerTable  {
+  Peer peers[MAXPEERS];
+  bool overflow;
+  unsigned long overflowTime;
+};
+
+//  This kettle's place in the schedule, as its last beacon advertised it
+struct PowerDemand  {
+  const char* id;
+  unsigned int cap;
+  unsigned int watts;
+  int priority;
+  unsigned int secondsToTarget;
+};
+
+//  Reads an unsigned beacon, false if any field is missing or too long
+bool beaconParse(const char* text, Beacon &beacon);
+
+/**
+ * @brief Adds or refreshes the peer a beacon came from. A peer that has
+ * expired keeps its sequence until its slot is needed for another kettle
+ * @param now milliseconds, compared by subtraction so it may wrap
+ * @return false when the beacon is not newer than the last one from that kettle
+ */
+bool peerUpdate(PeerTable &table, const Beacon &beacon, unsigned long now);
+
+/**
+ * @brief Drops peers and the overflow flag not refreshed within PEERTIMEOUT.
+ * A peer last heard with a demand is kept until its time to target has also passed
+ */
+void peerExpire(PeerTable &table, unsigned long now);
+
+void peerClear(PeerTable &table);
+
+/**
+ * @brief Works out whether this kettle may start heating.
+ * Kettles already heating keep their share of the cap. Waiting kettles are
+ * taken in order of priority, then shortest time to target, then id, and
+ * granted while they fit; the first one that does not fit stops the rest so
+ * a large kettle is not starved by smaller ones behind it.
+ * Waiting kettles rated above the cap can never be granted and are passed over.
+ * Every kettle sees the same beacons and so reaches the same schedule, as long
+ * as each one places itself by what its own last beacon said.
+ */
+bool powerScheduled(const PeerTable &table, const PowerDemand &own);
+
+//  Kettles may have been given different caps, the lowest one heard is used
+unsigned int circuitCap(const PeerTable &table, unsigned int ownCap);
+
+//  Order kettles are granted power in
+bool scheduledBefore(int priority, unsigned int seconds, const char* id,
+                     int otherPriority, unsigned int otherSeconds, const char* otherId);
+
+#endif
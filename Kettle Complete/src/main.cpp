@@ -6,8 +6,12 @@
 #include <ESPmDNS.h>
 #include <WiFi.h>
 #include <WiFiClient.h>
-#include <WebServer.h>
+#include <AsyncTCP.h>
+#include <ESPAsyncWebServer.h>
 #include <WebSocketsServer.h>
+#include <AsyncUDP.h>
+#include <KettleProtocol.h>
+#include <PowerSchedule.h>
 #include <analogWrite.h>
 #include <Ticker.h>
 #include <Preferences.h>
@@ -39,6 +43,12 @@
 #define TEMPERATURENOMINAL       25   
 #define MAX_VALUE              4096 //ESP32
 #define r                         0.05f
+#define CALIBRATIONPOINTS         3
+#define CALIBRATIONSAMPLES       64
+#define CALIBRATIONSPREAD         5.0f  //  Degrees the reference points must differ by
+#define PROFILEWEIGHT             0.3f  //  Weight of the latest boil in the heating profile
+#define MINPROFILERISE            5.0f  //  Smallest rise in a boil worth learning the rate from
+#define MAXOVERSHOOT             10.0f
 
 //  Error Handling
 #define MAXHEATINGTIME        100000.0f
@@ -46,6 +56,20 @@
 //  Kettle cooldown
 #define COOLDOWNTIME          100000.0f
 
+//  UDP local control
+#define UDPCONTROLPORT         4210
+#define UDPBEACONPORT          4211
+#define UDPBEACONGROUP         IPAddress(239, 255, 42, 1)
+#define BEACONINTERVAL         2000
+#define UDPMAXPACKET            200
+#define UDPQUEUELENGTH            8
+
+//  Power budget shared with other kettles on the circuit
+#define DEFAULTWATTS           2200
+#define DEFAULTCIRCUIT         "main"
+#define QUEUESETTLE            (BEACONINTERVAL * 3 / 2)
+#define HEATINGRATE              0.1f   //  Degrees per second until the kettle has learnt its own
+
 float kettleTargetTemprature = 40.0;
 
 // Demo define will allow for Serial 
@@ -63,6 +87,7 @@ void idleHandle();
 void heatingHandle();
 void preInitHandle();
 void postInitHandle();
+void queuedHandle();
 void postHeatingHandle();
 
 //  Error Handling
@@ -78,19 +103,62 @@ void WiFiCredentialCheck();
 void WiFiErrorHandle();
 
 //  Website Handle
-void setupPage();
-void homePage();
-void debugPage();
+void setupPage(AsyncWebServerRequest *request);
+void homePage(AsyncWebServerRequest *request);
+void debugPage(AsyncWebServerRequest *request);
+void pageSend(AsyncWebServerRequest *request, const char* page, size_t length, AwsTemplateProcessor processor = nullptr);
+String homePageTemplate(const String& placeholder);
 
 //  WiFi Misc
 void webSocketEvent(uint8_t num, WStype_t type, uint8_t * payload, size_t length);
 void wifiCredentials(const char* property, const char* param);
 String wifiScan();
 
+//  Result of a single command, sent back as ACK or ERR when it has a request ID
+enum CommandStatus  {
+  CMD_OK,
+  CMD_UNKNOWN,
+  CMD_BUSY,
+  CMD_INVALID,
+  CMD_REPLAY,
+  CMD_DENIED
+};
+
 //  Websocket Event and Server handle
 void payloadConvert(char* payload, uint8_t num);
-void doTheThing(char* property, uint8_t num);
-void doTheThingWith(char* property, char* param, uint8_t num);
+void commandHandle(char* command, String &reply, String &acks, bool authenticated);
+CommandStatus runCommand(char* command, String &reply, bool authenticated);
+CommandStatus doTheThing(char* property, String &reply);
+CommandStatus doTheThingWith(char* property, char* param, String &reply, bool authenticated);
+
+//  UDP local control
+void udpSetup();
+void udpReceive(AsyncUDPPacket &packet);
+void udpCommandHandle();
+void beaconHandle();
+bool udpKeySave(const char* hexKey);
+void udpSign(String &message, const uint8_t* key);
+
+//  Power budget
+void powerSetup();
+void beaconReceive(AsyncUDPPacket &packet);
+void peerHandle();
+bool powerGranted();
+void startHeating();
+unsigned int secondsToTarget();
+CommandStatus powerSetting(const char* key, const char* param);
+
+//  Live state updates
+void liveUpdateHandle();
+
+//  Thermistor calibration and heating profile
+void thermalSetup();
+float thermistorRead(int samples);
+float thermistorResistance(float reading);
+CommandStatus calibrationPoint(const char* param, String &reply);
+CommandStatus calibrationFit(String &reply);
+void calibrationClear();
+void profileSave();
 
 //  Misc
 void onStartTimer();
@@ -101,6 +169,7 @@ enum KettleState  {
   IDLE,
   PRE_INIT,
   POST_INIT,
+  QUEUED,
   HEATING,
   POST_HEAT,
   ERROR
@@ -114,24 +183,45 @@ void (*STATE_HANDLERS[])() = {
   &idleHandle,
   &preInitHandle,
   &postInitHandle,
+  &queuedHandle,
   &heatingHandle,
   &postHeatingHandle,
   &errorHandle
 };
 
+//  Names sent to the website, must follow the order of KettleState
+const char* STATE_NAMES[] = {
+  "IDLE",
+  "PRE_INIT",
+  "POST_INIT",
+  "QUEUED",
+  "HEATING",
+  "POST_HEAT",
+  "ERROR"
+};
+
 KettleState state = IDLE;
+KettleState previousState = state;
 
-#ifdef DEBUG
-  KettleState previousState = state;
-#endif
+//  Smoothed temperature, sampled once per loop
+float kettleTemprature = 0.0;
+float previousTemprature = 0.0;
+
+//  Smallest temperature change worth sending to the website
+#define TEMPRATURESTEP           0.5f
 
 Ticker startTimer;
 
+//  Set while startTimer runs, the state reads IDLE during that time
+volatile bool startPending = false;
+
 unsigned long heatingTime;
 unsigned long coolingTime;
 
 //  Declare WebServers
-WebServer server(80);
+//  The HTTP server is event driven and answers requests on the AsyncTCP task,
+//  so it no longer needs to be polled from loop()
+AsyncWebServer server(80);
 WebSocketsServer webSocket(81);
 
 //  Global Variables
@@ -142,8 +232,99 @@ Preferences flashStorage;
 
 String WiFiErrorMessage = "";
 
+//  True while the kettle runs its own access point for first time setup
+bool setupMode = false;
+
 String errorMessage = "";
 
+//  Set by commands that reboot the kettle, so replies are sent before restarting
+bool restartPending = false;
+
+//  Error names sent in ERR replies, must follow the order of CommandStatus
+const char* COMMAND_ERRORS[] = {
+  "",
+  "UNKNOWN",
+  "BUSY",
+  "INVALID",
+  "REPLAY",
+  "DENIED"
+};
+
+/**
+ * UDP commands are received on the AsyncUDP task and handed to loop() through
+ * udpQueue, so the state machine is still only ever changed from one task
+ */
+struct UdpPacket  {
+  uint32_t ip;
+  uint16_t port;
+  char data[UDPMAXPACKET + 1];
+};
+
+AsyncUDP udp;
+QueueHandle_t udpQueue;
+
+//  Shared secret for signing UDP commands, beacons and replies
+uint8_t udpKey[HMACSIZE];
+bool udpKeyLoaded = false;
+
+//  Highest command counter accepted, anything not above it is a replay
+CounterWindow udpCounter = {0, 0};
+
+unsigned long beaconTime;
+
+//  Sequence of the last beacon sent, reserved in flash the same way as udpCounter
+CounterWindow beaconCounter = {0, 0};
+
+//  Name used in beacons and mDNS, "kettle-" followed by the end of the MAC
+String deviceId;
+
+/**
+ * Kettles on one circuit share a power cap. Every beacon carries the kettle's
+ * circuit, cap and demand, and each kettle works out the same schedule from
+ * the beacons it hears on its own circuit, see PowerSchedule
+ */
+PeerTable peerTable;
+
+AsyncUDP beaconUdp;
+QueueHandle_t beaconQueue;
+
+String kettleCircuit = DEFAULTCIRCUIT;
+unsigned int powerCap = 0;              //  Watts for the whole circuit, 0 turns coordination off
+unsigned int kettleWatts = DEFAULTWATTS;
+int kettlePriority = 0;
+
+unsigned long queuedTime;
+
+//  Place in the schedule taken on queueing, held while queued so a noisy
+//  reading cannot swap this kettle's order with a peer's
+int queuedPriority = 0;
+unsigned int queuedSeconds = 0;
+
+//  What the last beacon told the other kettles, the schedule is worked out from these
+unsigned int advertisedWatts = 0;
+int advertisedPriority = 0;
+unsigned int advertisedSeconds = 0;
+
+/**
+ * Steinhart-Hart coefficients, 1/T = A + B ln(R) + C ln(R)^3, fitted from
+ * reference points for this kettle's thermistor. Until a fit is stored the
+ * nominal B coefficient defines are used instead
+ */
+bool thermistorCalibrated = false;
+double steinhartA, steinhartB, steinhartC;
+
+//  Reference points captured while calibrating, cleared after a fit
+float calibrationTemprature[CALIBRATIONPOINTS];
+float calibrationResistance[CALIBRATIONPOINTS];
+int calibrationCount = 0;
+
+//  Heating profile learnt from previous boils
+float heatingRate = HEATINGRATE;
+float heatingOvershoot = 0.0;
+
+float heatingStartTemprature;
+float peakTemprature;
+
 void setup() {
   #ifdef DEBUG
   Serial.begin(115200);
@@ -161,6 +342,8 @@ void setup() {
   //  Relay Switch
   pinMode(relay, OUTPUT);
 
+  thermalSetup();
+
   attachInterrupt(KETTLESWITCH, onStartPressISR, RISING);
 
   flashStorage.begin("credentials", false);
@@ -171,7 +354,7 @@ void setup() {
   else WiFiCredentialCheck();
 
   #ifdef DEBUG
-    server.on("/debug", debugPage);
+    server.on("/debug", HTTP_GET, debugPage);
   #endif
 
   //  mDNS Setup "https://Kettle.local/"
@@ -181,6 +364,13 @@ void setup() {
   //  Add service to MDNS-SD
   MDNS.addService("https", "tcp", 80);
 
+  udpSetup();
+  powerSetup();
+
+  server.onNotFound([](AsyncWebServerRequest *request){
+    request->send(404, "text/plain", "Not found");
+  });
+
   //  Starts WebServer and WebSocket
   server.begin();
   webSocket.begin();
@@ -188,24 +378,44 @@ void setup() {
 }
 
 void loop() {
+  kettleTemprature = getTemperaure();
+
   STATE_HANDLERS[state]();
 
   //  Handles Websocket
   webSocket.loop();
 
-  // Handles WebServer
-  server.handleClient();
+  //  Handles UDP commands and status beacons
+  udpCommandHandle();
+  peerHandle();
+  beaconHandle();
+
+  if(restartPending) ESP.restart();
 
   // Handles Errors
   if(!(WiFiErrorMessage == "")) WiFiErrorHandle();
-  
-  #ifdef DEBUG  
-    if(state != previousState)  {
-      previousState = state;
+
+  liveUpdateHandle();
+}
+
+/**
+ * @brief The home page arrives with the current values already filled in,
+ * so the WebSocket only has to carry what changed since then
+ */
+void liveUpdateHandle()
+{
+  if(state != previousState)  {
+    previousState = state;
+    webSocket.broadcastTXT("STATE," + String(STATE_NAMES[state]));
+    #ifdef DEBUG
       webSocket.broadcastTXT("DEBUG,STATE," + String(state));
-    }
-  #endif
+    #endif
+  }
 
+  if(fabs(kettleTemprature - previousTemprature) >= TEMPRATURESTEP)  {
+    previousTemprature = kettleTemprature;
+    webSocket.broadcastTXT("TEMPERATURE," + String(kettleTemprature, 1));
+  }
 }
 
 void WiFiSetupHandle()
@@ -215,9 +425,10 @@ void WiFiSetupHandle()
 
   //  Start of the Soft Access Point
   Serial.println(WiFi.softAP(softAPName) ? "Ready" : "Failed!");
+  setupMode = true;
 
   //  WiFi Setup Page
-  server.on("/", setupPage);
+  server.on("/", HTTP_GET, setupPage);
 }
 
 void WiFiCredentialCheck()
@@ -235,7 +446,7 @@ void WiFiCredentialCheck()
     WiFiSetupHandle();
   }
   else{
-    server.on("/", homePage);
+    server.on("/", HTTP_GET, homePage);
   }
 }
 
@@ -272,19 +483,56 @@ void wifiCredentials(const char* property, const char* param)
   flashStorage.end();
 }
 
-void setupPage()
+void setupPage(AsyncWebServerRequest *request)
+{
+  pageSend(request, WIFISETUP, sizeof(WIFISETUP) - 1);
+}
+
+void homePage(AsyncWebServerRequest *request)
 {
-  server.send(200, "text/html", WIFISETUP);
+  pageSend(request, MAIN, sizeof(MAIN) - 1, homePageTemplate);
 }
 
-void homePage()
+/**
+ * @brief Sends a page with HTTP chunked transfer encoding, each chunk is
+ * copied out of flash as AsyncTCP has room for it so the page is never held in RAM.
+ * Chunked also means no Content-Length is needed once the template has changed the size.
+ * HTTP/1.0 clients get the same bytes closed by end of connection instead.
+ * Keep-alive is not offered, ESPAsyncWebServer closes the connection after every response
+ * @param page PROGMEM page
+ * @param length page length without the terminator
+ * @param processor fills %PLACEHOLDERS% as the page goes out, or nullptr
+ */
+void pageSend(AsyncWebServerRequest *request, const char* page, size_t length, AwsTemplateProcessor processor)
+{
+  AsyncWebServerResponse *response = request->beginChunkedResponse("text/html",
+    [page, length](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+    {
+      if(index >= length) return 0;
+      size_t chunk = min(maxLen, length - index);
+      memcpy_P(buffer, page + index, chunk);
+      return chunk;
+    }, processor);
+  request->send(response);
+}
+
+/**
+ * @brief Fills the %PLACEHOLDERS% in MAIN while it is streamed out,
+ * the page itself is never copied out of flash
+ * @param placeholder name between the % signs
+ * @return short value written in its place
+ */
+String homePageTemplate(const String& placeholder)
 {
-  server.send(200, "text/html", MAIN);
+  if(placeholder == "STATE") return STATE_NAMES[state];
+  if(placeholder == "TEMPERATURE") return String(kettleTemprature, 1);
+  if(placeholder == "TARGET") return String(kettleTargetTemprature, 1);
+  return String();
 }
 
-void debugPage()
+void debugPage(AsyncWebServerRequest *request)
 {
-  server.send(200, "text/html", DEBUGPAGE);
+  pageSend(request, DEBUGPAGE, sizeof(DEBUGPAGE) - 1);
 }
 
 void webSocketEvent(uint8_t num, WStype_t type, uint8_t * payload, size_t length) {
@@ -304,6 +552,10 @@ void webSocketEvent(uint8_t num, WStype_t type, uint8_t * payload, size_t length
         // Send message to client
         webSocket.sendTXT(num, "Connected");
 
+        //  Closes the gap between the page being served and the socket opening
+        webSocket.sendTXT(num, "STATE," + String(STATE_NAMES[state]));
+        webSocket.sendTXT(num, "TEMPERATURE," + String(kettleTemprature, 1));
+
         #ifdef DEBUG
           webSocket.sendTXT(num, "DEBUG,STATE," + String(state));
         #endif
@@ -327,67 +579,425 @@ void webSocketEvent(uint8_t num, WStype_t type, uint8_t * payload, size_t length
   }
 }
 
+/**
+ * @brief A frame holds one or more commands separated by new lines,
+ * they are run in order without waiting between them.
+ * A command can start with a numeric request ID, "7:SWITCH", in which case
+ * its result is acknowledged as "ACK,7" or "ERR,7,BUSY" and all of the
+ * frame's acknowledgements are sent back together in one reply.
+ * Commands without an ID keep their original replies.
+ * @param payload null terminated text frame
+ * @param num websocket client
+ */
 void payloadConvert(char* payload, uint8_t num){
-  char* p = strchr(payload, ',');
+  String acks = "";
+  char* command = payload;
+
+  while(command) {
+    char* next = strchr(command, '\n');
+    if(next) {
+      *next = '\0';
+      next++;
+    }
+
+    size_t length = strlen(command);
+    if(length && command[length - 1] == '\r') command[length - 1] = '\0';
+
+    if(*command) {
+      String reply = "";
+      commandHandle(command, reply, acks, false);
+      if(reply != "") webSocket.sendTXT(num, reply);
+    }
+
+    command = next;
+  }
+
+  if(acks != "") webSocket.sendTXT(num, acks);
+}
+
+/**
+ * @brief Runs one command, splitting off its request ID if it has one
+ * @param command single command, modified in place
+ * @param reply set to the plain reply for commands without a request ID
+ * @param acks acknowledgement appended to for commands with a request ID
+ * @param authenticated true for signed UDP commands, false for the WebSocket
+ */
+void commandHandle(char* command, String &reply, String &acks, bool authenticated){
+  char* id = command;
+  size_t idLength = requestIdLength(command);
+
+  if(!idLength) {
+    runCommand(command, reply, authenticated);
+    return;
+  }
+
+  id[idLength] = '\0';
+  String result = "";
+  CommandStatus status = runCommand(id + idLength + 1, result, authenticated);
+
+  if(acks != "") acks += "\n";
+  if(status == CMD_OK) {
+    acks += "ACK," + String(id);
+    if(result != "") acks += "," + result;
+  }
+  else {
+    acks += "ERR," + String(id) + "," + COMMAND_ERRORS[status];
+  }
+}
+
+CommandStatus runCommand(char* command, String &reply, bool authenticated){
+  char* p = strchr(command, ',');
   if(p) {
     *p='\0';
     p++;
-    doTheThingWith(payload, p, num);
-  }
-  else
-  {
-    doTheThing(payload, num);
+    return doTheThingWith(command, p, reply, authenticated);
   }
+  return doTheThing(command, reply);
 }
 
-void doTheThing(char* property, uint8_t num)
+CommandStatus doTheThing(char* property, String &reply)
 {
   if(strcmp(property, "WIFI") == 0){
-    webSocket.sendTXT(num, "NETWORKS," + networksDetected);
+    reply = "NETWORKS," + networksDetected;
   }
   else if(strcmp(property, "SWITCH") == 0){
+    if(state != IDLE || startPending) return CMD_BUSY;
     state = PRE_INIT;
     webSocket.broadcastTXT("STATE CHANGED");
   }
+  else if(strcmp(property, "CalFit") == 0){
+    return calibrationFit(reply);
+  }
+  else if(strcmp(property, "CalClear") == 0){
+    calibrationClear();
+  }
   else if(strcmp(property, "RESET") == 0){
     flashStorage.clear();
     wifiCredentials("SSID", "");
     wifiCredentials("PASSWORD", "");
-    ESP.restart();
+    restartPending = true;
   }
+  else{
+    return CMD_UNKNOWN;
+  }
+  return CMD_OK;
 }
 
-void doTheThingWith(char* property, char* param, uint8_t num)
+CommandStatus doTheThingWith(char* property, char* param, String &reply, bool authenticated)
 {
   if(strcmp(property, "AccessPointName") == 0){
     wifiCredentials("SSID", param);
-    webSocket.sendTXT(num, "Access Point Name Saved");
+    reply = "Access Point Name Saved";
   }
   else if(strcmp(property, "AccessPointPassword") == 0){
     wifiCredentials("PASSWORD", param);
-    webSocket.sendTXT(num, "Access Point Password Saved");
-    ESP.restart();
+    reply = "Access Point Password Saved";
+    restartPending = true;
+  }
+  else if(strcmp(property, "Circuit") == 0 || strcmp(property, "PowerCap") == 0 ||
+          strcmp(property, "PowerRating") == 0 || strcmp(property, "Priority") == 0){
+    return powerSetting(property, param);
+  }
+  else if(strcmp(property, "CalPoint") == 0){
+    return calibrationPoint(param, reply);
+  }
+  else if(strcmp(property, "UdpKey") == 0){
+    //  Over the open WebSocket only the first key, and only during setup,
+    //  after that the key can only be changed by a command signed with it
+    if(!authenticated && (udpKeyLoaded || !setupMode)) return CMD_DENIED;
+    if(!udpKeySave(param)) return CMD_INVALID;
+    reply = "UDP Key Saved";
   }
   else{
     Serial.printf("Property: %s | Param: %s \n", property, param);
+    return CMD_UNKNOWN;
+  }
+  return CMD_OK;
+}
+
+/**
+ * @brief Starts the UDP control port and announces it over mDNS.
+ * Commands are single packets of "<counter>:<command>|<hmac>", where the
+ * counter must increase with every command and doubles as the request ID,
+ * and hmac is the lower case hex HMAC-SHA256 of everything before the '|'.
+ * Counters may be up to MAXREQUESTID digits, a millisecond timestamp works.
+ * Replies are the usual ACK or ERR line, signed the same way. A counter that
+ * is not newer gets "ERR,<counter>,REPLAY,<last accepted>", an unreadable one
+ * "ERR,0,INVALID".
+ * Status beacons are multicast to UDPBEACONGROUP every BEACONINTERVAL as
+ * "STATUS,<id>,<state>,<temperature>,<target>,<circuit>,<cap>,<watts>,<priority>,<seconds to target>,<sequence>",
+ * signed the same way when the kettle has a key. The sequence goes up with
+ * every beacon and carries on after a reboot, so a recorded beacon is refused.
+ */
+void udpSetup()
+{
+  flashStorage.begin("udp", true);
+  String hexKey = flashStorage.getString("KEY", "");
+  uint64_t reserved = flashStorage.getULong64("COUNTER", 0);
+  uint64_t beaconReserved = flashStorage.getULong64("BEACON", 0);
+  flashStorage.end();
+
+  //  Counters up to the saved reservation may have been used before the reboot
+  udpCounter = {reserved, reserved};
+  beaconCounter = {beaconReserved, beaconReserved};
+
+  if(hexKey != "") udpKeyLoaded = hexToBytes(hexKey.c_str(), udpKey, HMACSIZE);
+
+  String mac = WiFi.macAddress();
+  mac.replace(":", "");
+  mac.toLowerCase();
+  deviceId = "kettle-" + mac.substring(6);
+
+  udpQueue = xQueueCreate(UDPQUEUELENGTH, sizeof(UdpPacket));
+  if(udp.listen(UDPCONTROLPORT)) udp.onPacket(udpReceive);
+  else Serial.println("Error starting UDP control!");
+
+  MDNS.addService("kettle", "udp", UDPCONTROLPORT);
+  MDNS.addServiceTxt("kettle", "udp", "id", deviceId);
+  MDNS.addServiceTxt("kettle", "udp", "beacon", UDPBEACONGROUP.toString() + ":" + String(UDPBEACONPORT));
+}
+
+//  Runs on the AsyncUDP task, only copies the packet for loop()
+void udpReceive(AsyncUDPPacket &packet)
+{
+  if(packet.length() > UDPMAXPACKET) return;
+
+  UdpPacket received;
+  received.ip = packet.remoteIP();
+  received.port = packet.remotePort();
+  memcpy(received.data, packet.data(), packet.length());
+  received.data[packet.length()] = '\0';
+
+  xQueueSend(udpQueue, &received, 0);
+}
+
+void udpCommandHandle()
+{
+  UdpPacket received;
+  while(xQueueReceive(udpQueue, &received, 0) == pdTRUE) {
+    if(!udpKeyLoaded) continue;
+
+    uint8_t requestKey[HMACSIZE];
+    memcpy(requestKey, udpKey, HMACSIZE);
+
+    uint64_t counter;
+    UdpVerdict verdict = udpVerify(received.data, udpKey, udpCounter.last, counter);
+
+    //  Unsigned and forged packets are dropped without a reply
+    if(verdict == UDP_UNSIGNED || verdict == UDP_FORGED) continue;
+
+    String acks = "";
+    char rejected[UDPREPLYSIZE + 1];
+    if(udpReply(verdict, counter, udpCounter.last, rejected)) {
+      acks = rejected;
+    }
+    else {
+      //  Only written once per COUNTERBLOCK, and before the command runs
+      if(counterAccept(udpCounter, counter)) {
+        flashStorage.begin("udp", false);
+        flashStorage.putULong64("COUNTER", udpCounter.reserved);
+        flashStorage.end();
+      }
+
+      String reply = "";
+      commandHandle(received.data, reply, acks, true);
+    }
+
+    //  Signed with the key the request was checked against, UdpKey may have replaced it
+    udpSign(acks, requestKey);
+    udp.writeTo((const uint8_t*)acks.c_str(), acks.length(), IPAddress(received.ip), received.port);
   }
 }
 
+void beaconHandle()
+{
+  if(millis() - beaconTime < BEACONINTERVAL) return;
+  beaconTime = millis();
+
+  //  Queued and heating kettles advertise their demand on the circuit
+  advertisedWatts = (state == QUEUED || state == HEATING) ? kettleWatts : 0;
+  advertisedPriority = state == QUEUED ? queuedPriority : kettlePriority;
+  advertisedSeconds = state == QUEUED ? queuedSeconds : secondsToTarget();
+
+  if(counterAccept(beaconCounter, beaconCounter.last + 1)) {
+    flashStorage.begin("udp", false);
+    flashStorage.putULong64("BEACON", beaconCounter.reserved);
+    flashStorage.end();
+  }
+  char sequence[MAXREQUESTID + 1];
+  counterWrite(sequence, beaconCounter.last);
+
+  String beacon = "STATUS," + deviceId + "," + STATE_NAMES[state] + "," +
+                  String(kettleTemprature, 1) + "," + String(kettleTargetTemprature, 1) + "," +
+                  kettleCircuit + "," + String(powerCap) + "," + String(advertisedWatts) + "," + String(advertisedPriority) + "," + String(advertisedSeconds) + "," + sequence;
+  if(udpKeyLoaded) udpSign(beacon, udpKey);
+
+  udp.writeTo((const uint8_t*)beacon.c_str(), beacon.length(), UDPBEACONGROUP, UDPBEACONPORT);
+}
+
+/**
+ * @brief Stores a new UDP key, given as 64 hex characters.
+ * The command counter carries on, so old commands stay rejected
+ */
+bool udpKeySave(const char* hexKey)
+{
+  uint8_t key[HMACSIZE];
+  if(strlen(hexKey) != HMACHEXSIZE || !hexToBytes(hexKey, key, HMACSIZE)) return false;
+
+  memcpy(udpKey, key, HMACSIZE);
+  udpKeyLoaded = true;
+
+  flashStorage.begin("udp", false);
+  flashStorage.putString("KEY", hexKey);
+  flashStorage.end();
+  return true;
+}
+
+//  Appends "|<hmac>" of the message
+void udpSign(String &message, const uint8_t* key)
+{
+  char mac[HMACHEXSIZE + 1];
+  hmacHex(key, message.c_str(), message.length(), mac);
+  message += "|";
+  message += mac;
+}
+
+void powerSetup()
+{
+  flashStorage.begin("power", true);
+  kettleCircuit = flashStorage.getString("CIRCUIT", DEFAULTCIRCUIT);
+  powerCap = flashStorage.getUInt("CAP", 0);
+  kettleWatts = flashStorage.getUInt("WATTS", DEFAULTWATTS);
+  kettlePriority = flashStorage.getInt("PRIORITY", 0);
+  flashStorage.end();
+
+  beaconQueue = xQueueCreate(UDPQUEUELENGTH, sizeof(UdpPacket));
+  if(beaconUdp.listenMulticast(UDPBEACONGROUP, UDPBEACONPORT)) beaconUdp.onPacket(beaconReceive);
+  else Serial.println("Error joining beacon group!");
+}
+
+//  Runs on the AsyncUDP task, only copies the beacon for loop()
+void beaconReceive(AsyncUDPPacket &packet)
+{
+  if(packet.length() > UDPMAXPACKET) return;
+
+  UdpPacket received;
+  received.ip = packet.remoteIP();
+  received.port = packet.remotePort();
+  memcpy(received.data, packet.data(), packet.length());
+  received.data[packet.length()] = '\0';
+
+  xQueueSend(beaconQueue, &received, 0);
+}
+
+/**
+ * @brief Keeps the table of kettles heard on this kettle's circuit.
+ * When this kettle has a UDP key, only beacons signed with it are trusted,
+ * and peerUpdate refuses any not newer than the last from the same kettle
+ */
+void peerHandle()
+{
+  UdpPacket received;
+  while(xQueueReceive(beaconQueue, &received, 0) == pdTRUE) {
+    char* mac = strrchr(received.data, '|');
+    if(mac) {
+      *mac = '\0';
+      mac++;
+    }
+    if(udpKeyLoaded && (!mac || !hmacMatches(udpKey, received.data, strlen(received.data), mac))) continue;
+
+    Beacon beacon;
+    if(!beaconParse(received.data, beacon)) continue;
+    if(deviceId == beacon.id || kettleCircuit != beacon.circuit) continue;
+
+    peerUpdate(peerTable, beacon, millis());
+  }
+
+  peerExpire(peerTable, millis());
+}
+
+/**
+ * @brief Works out whether this kettle may start heating, placing it by what
+ * its last beacon advertised since that is all the other kettles have heard
+ */
+bool powerGranted()
+{
+  if(!powerCap) return true;
+
+  //  Give the other kettles time to hear this kettle's demand first
+  if(!advertisedWatts || millis() - queuedTime < QUEUESETTLE) return false;
+
+  PowerDemand own = {deviceId.c_str(), powerCap, advertisedWatts, advertisedPriority, advertisedSeconds};
+  return powerScheduled(peerTable, own);
+}
+
+unsigned int secondsToTarget()
+{
+  if(kettleTemprature >= kettleTargetTemprature) return 0;
+  return (kettleTargetTemprature - kettleTemprature) / heatingRate;
+}
+
+//  Circuit, PowerCap, PowerRating and Priority commands, saved so they survive a reboot
+CommandStatus powerSetting(const char* key, const char* param)
+{
+  if(strcmp(key, "Circuit") == 0){
+    //  Goes into the beacon, so no separators and short enough for peers to read
+    size_t length = strlen(param);
+    if(length == 0 || length >= CIRCUITSIZE) return CMD_INVALID;
+    for(size_t i = 0; i < length; i++){
+      if(!isalnum((unsigned char)param[i]) && param[i] != '-' && param[i] != '_') return CMD_INVALID;
+    }
+
+    kettleCircuit = param;
+    peerClear(peerTable);
+    flashStorage.begin("power", false);
+    flashStorage.putString("CIRCUIT", kettleCircuit);
+    flashStorage.end();
+    return CMD_OK;
+  }
+
+  char* end;
+  long value = strtol(param, &end, 10);
+  if(end == param || *end != '\0') return CMD_INVALID;
+  if(strcmp(key, "Priority") != 0 && value < 0) return CMD_INVALID;
+  //  A kettle that draws nothing would never count against the cap
+  if(strcmp(key, "PowerRating") == 0 && value <= 0) return CMD_INVALID;
+
+  flashStorage.begin("power", false);
+  if(strcmp(key, "PowerCap") == 0){
+    powerCap = value;
+    flashStorage.putUInt("CAP", powerCap);
+  }
+  else if(strcmp(key, "PowerRating") == 0){
+    kettleWatts = value;
+    flashStorage.putUInt("WATTS", kettleWatts);
+  }
+  else{
+    kettlePriority = value;
+    flashStorage.putInt("PRIORITY", kettlePriority);
+  }
+  flashStorage.end();
+  return CMD_OK;
+}
+
 void idleHandle(){
   rgbHandle(0,255,255);
 }
 
 void preInitHandle(){
+  startPending = true;
   startTimer.attach_ms(2000, onStartTimer);
   state = IDLE;
 }
 
+//  Same rule as SWITCH, a press mid-boil must not reset the state with the relay on
 void onStartPressISR(){
-  state = PRE_INIT;
+  if(state == IDLE && !startPending) state = PRE_INIT;
 }
 
 void onStartTimer(){
   startTimer.detach();
+  startPending = false;
   state = POST_INIT;
 }
 
@@ -402,21 +1012,64 @@ void postInitHandle(){
     return;
   }
 
+  //  The lowest cap on the circuit is the one the schedule keeps to
+  if(powerCap && kettleWatts > circuitCap(peerTable, powerCap)){
+    errorState("Kettle rating is above the circuit power cap");
+    state = IDLE;
+    return;
+  }
+
+  if(powerCap){
+    //  Wait for a slot under the power cap, the next beacon announces the demand
+    state = QUEUED;
+    queuedTime = millis();
+    queuedPriority = kettlePriority;
+    queuedSeconds = secondsToTarget();
+    beaconTime = 0;
+    rgbHandle(0,0,255);
+    return;
+  }
+
+  startHeating();
+}
+
+void queuedHandle(){
+  //  Mug or water removed, or a lower cap heard, while waiting, let POST_INIT report it
+  if(!digitalRead(MUGSWITCH) || !digitalRead(WATERSWITCH) || kettleWatts > circuitCap(peerTable, powerCap)){
+    state = POST_INIT;
+    return;
+  }
+
+  if(powerGranted()) startHeating();
+}
+
+void startHeating(){
   state = HEATING;
   rgbHandle(0,255,0);
   attachInterrupt(MUGSWITCH, errorMug, FALLING);
   attachInterrupt(WATERSWITCH, errorWater, FALLING);
   heatingTime = millis();
+  heatingStartTemprature = kettleTemprature;
   digitalWrite(relay, HIGH);
+
+  //  Beacon straight away, a peer about to decide must know this power is now drawn
+  beaconTime = 0;
 }
 
 void heatingHandle(){
-  if(getTemperaure() >= kettleTargetTemprature){
+  //  Switch off early by the learnt overshoot, the element keeps heating for a while
+  if(kettleTemprature >= kettleTargetTemprature - heatingOvershoot){
     state = POST_HEAT;
     digitalWrite(relay, LOW);       //  Turn off the kettle
     detachInterrupt(KETTLESWITCH);  //  Turn off the switch controling the switch
     rgbHandle(255,128,0);
     coolingTime = millis();
+
+    float heatingSeconds = (millis() - heatingTime) / 1000.0f;
+    float rise = kettleTemprature - heatingStartTemprature;
+    if(rise > MINPROFILERISE && heatingSeconds > 0)
+      heatingRate = heatingRate * (1.0f - PROFILEWEIGHT) + (rise / heatingSeconds) * PROFILEWEIGHT;
+    peakTemprature = kettleTemprature;
     return;
   }
   else if(millis() - heatingTime > MAXHEATINGTIME){
@@ -426,10 +1079,9 @@ void heatingHandle(){
   }
   else{
     state = HEATING;
+    //  The website is sent the temperature by liveUpdateHandle when it moves by TEMPRATURESTEP
     #ifdef DEBUG
-      float tempTemprature = getTemperaure();
-      Serial.println(tempTemprature);
-      webSocket.broadcastTXT("SENSORS,THERMISTOR,"  + String(tempTemprature));
+      Serial.println(kettleTemprature);
     #endif
     digitalWrite(relay, HIGH);
     return;
@@ -437,7 +1089,14 @@ void heatingHandle(){
 }
 
 void postHeatingHandle(){
+  peakTemprature = max(peakTemprature, kettleTemprature);
+
   if(millis() - coolingTime > COOLDOWNTIME){
+    float overshoot = heatingOvershoot + peakTemprature - kettleTargetTemprature;
+    overshoot = constrain(overshoot, 0.0f, MAXOVERSHOOT);
+    heatingOvershoot = heatingOvershoot * (1.0f - PROFILEWEIGHT) + overshoot * PROFILEWEIGHT;
+    profileSave();
+
     state = IDLE;
     attachInterrupt(KETTLESWITCH, onStartPressISR, RISING);
   }
@@ -471,13 +1130,149 @@ void errorState(String errorMessage){
   }
 
 float getTemperaure() {
-  int rawReading = analogRead(THERMISITORPIN);
+  float rawReading = thermistorRead(1);
   static float smoothedReading = rawReading;
   smoothedReading = rawReading*r + smoothedReading*(1.0f-r);
-  float partial = log(SERIEREISITOR / (((MAX_VALUE / smoothedReading)-1) * THERMISTORNOMINAL));
+
+  float resistance = thermistorResistance(smoothedReading);
+  if(thermistorCalibrated) {
+    double lnR = log(resistance);
+    return 1.0 / (steinhartA + steinhartB * lnR + steinhartC * lnR * lnR * lnR) - 273.15;
+  }
+
+  float partial = log(resistance / THERMISTORNOMINAL);
   return 1.0 / (partial / BCOEFFICIENT + 1.0 / (TEMPERATURENOMINAL + 273.15)) - 273.15;
 }
 
+/**
+ * @brief Averages samples readings of the thermistor. It shares its pin with
+ * the red channel of the light, so the PWM is taken off the pin while it is
+ * read and put back afterwards at the same duty
+ */
+float thermistorRead(int samples) {
+  int redChannel = analogWriteChannel(REDPIN);
+  ledcDetachPin(REDPIN);
+  pinMode(THERMISITORPIN, INPUT);
+
+  float reading = 0;
+  for(int i = 0; i < samples; i++) reading += analogRead(THERMISITORPIN);
+
+  pinMode(REDPIN, OUTPUT);
+  ledcAttachPin(REDPIN, redChannel);
+  return reading / samples;
+}
+
+float thermistorResistance(float reading) {
+  return SERIEREISITOR / ((MAX_VALUE / reading) - 1);
+}
+
+/**
+ * @brief Loads this kettle's calibration and heating profile from flash
+ */
+void thermalSetup()
+{
+  flashStorage.begin("thermal", true);
+  thermistorCalibrated = flashStorage.getBool("CALIBRATED", false);
+  steinhartA = flashStorage.getDouble("SH_A", 0);
+  steinhartB = flashStorage.getDouble("SH_B", 0);
+  steinhartC = flashStorage.getDouble("SH_C", 0);
+  heatingRate = flashStorage.getFloat("RATE", HEATINGRATE);
+  heatingOvershoot = flashStorage.getFloat("OVERSHOOT", 0.0);
+  flashStorage.end();
+}
+
+/**
+ * @brief Captures a reference point, "CalPoint,<degrees>" with the water held
+ * at a known temperature. The reading is averaged over fresh samples rather
+ * than taken from the slow smoothed value. Only taken while IDLE, when the
+ * water is not being heated
+ */
+CommandStatus calibrationPoint(const char* param, String &reply)
+{
+  char* end;
+  float reference = strtof(param, &end);
+  if(end == param || *end != '\0') return CMD_INVALID;
+  if(state != IDLE || startPending) return CMD_BUSY;
+  if(calibrationCount == CALIBRATIONPOINTS) return CMD_BUSY;
+
+  float reading = thermistorRead(CALIBRATIONSAMPLES);
+  if(reading <= 0 || reading >= MAX_VALUE) return CMD_INVALID;
+
+  calibrationTemprature[calibrationCount] = reference;
+  calibrationResistance[calibrationCount] = thermistorResistance(reading);
+  calibrationCount++;
+
+  reply = "CALIBRATION," + String(calibrationCount) + "," + String(thermistorResistance(reading), 0);
+  return CMD_OK;
+}
+
+/**
+ * @brief Fits the Steinhart-Hart coefficients through the three captured
+ * points and stores them, the points must be CALIBRATIONSPREAD apart
+ */
+CommandStatus calibrationFit(String &reply)
+{
+  if(calibrationCount < CALIBRATIONPOINTS) return CMD_INVALID;
+
+  double L[CALIBRATIONPOINTS], Y[CALIBRATIONPOINTS];
+  for(int i = 0; i < CALIBRATIONPOINTS; i++) {
+    for(int j = 0; j < i; j++) {
+      if(fabs(calibrationTemprature[i] - calibrationTemprature[j]) < CALIBRATIONSPREAD) {
+        calibrationCount = 0;
+        return CMD_INVALID;
+      }
+    }
+    L[i] = log(calibrationResistance[i]);
+    Y[i] = 1.0 / (calibrationTemprature[i] + 273.15);
+  }
+  calibrationCount = 0;
+
+  double gamma2 = (Y[1] - Y[0]) / (L[1] - L[0]);
+  double gamma3 = (Y[2] - Y[0]) / (L[2] - L[0]);
+  double C = (gamma3 - gamma2) / (L[2] - L[1]) / (L[0] + L[1] + L[2]);
+  double B = gamma2 - C * (L[0] * L[0] + L[0] * L[1] + L[1] * L[1]);
+  double A = Y[0] - (B + L[0] * L[0] * C) * L[0];
+
+  //  Resistance must fall as temperature rises for an NTC thermistor
+  if(!isfinite(A) || !isfinite(B) || !isfinite(C) || B <= 0) return CMD_INVALID;
+
+  steinhartA = A;
+  steinhartB = B;
+  steinhartC = C;
+  thermistorCalibrated = true;
+
+  flashStorage.begin("thermal", false);
+  flashStorage.putDouble("SH_A", steinhartA);
+  flashStorage.putDouble("SH_B", steinhartB);
+  flashStorage.putDouble("SH_C", steinhartC);
+  flashStorage.putBool("CALIBRATED", true);
+  flashStorage.end();
+
+  reply = "CALIBRATION,FITTED," + String(A, 10) + "," + String(B, 10) + "," + String(C, 12);
+  return CMD_OK;
+}
+
+//  Back to the nominal constants, the heating profile is learnt again as well
+void calibrationClear()
+{
+  calibrationCount = 0;
+  thermistorCalibrated = false;
+  heatingRate = HEATINGRATE;
+  heatingOvershoot = 0.0;
+
+  flashStorage.begin("thermal", false);
+  flashStorage.clear();
+  flashStorage.end();
+}
+
+void profileSave()
+{
+  flashStorage.begin("thermal", false);
+  flashStorage.putFloat("RATE", heatingRate);
+  flashStorage.putFloat("OVERSHOOT", heatingOvershoot);
+  flashStorage.end();
+}
+
 /**
  * @brief Handles the RGB light in the top of the kettle
  * analogWrite is 0 to 255
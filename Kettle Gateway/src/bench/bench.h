@@ -0,0 +1,30 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/**
+ * Load generators and simulators for the kettle network, run from the host
+ * against a real kettle, a running gateway, or the loopback stand-ins here
+ */
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+//  Each mode takes the arguments after its name
+int benchUdp(int argc, char **argv);
+int benchUdpKettle(int argc, char **argv);
+int benchGateway(int argc, char **argv);
+int benchHttp(int argc, char **argv);
+int benchPower(int argc, char **argv);
+
+//  Prints count, p50, p99 and max of a set of latencies in milliseconds
+void printLatency(const char* label, std::vector<double> &milliseconds);
+
+double msBetween(Clock::time_point start, Clock::time_point end);
+
+//  Value of "--name" in argv, or fallback
+std::string option(int argc, char **argv, const char* name, const char* fallback);
+
+#endif
@@ -0,0 +1,182 @@
+/**
+ * "gateway" stands in for a room of kettles and a set of dashboards around a
+ * running gateway. It multicasts beacons for --kettles fake kettles, spread
+ * over each BEACONINTERVAL as the firmware would, while --clients TCP clients
+ * read the merged stream. Every beacon carries a sequence number in its
+ * temperature field, so each one is a change the gateway must pass on, and a
+ * client can time it from the moment it was sent to the moment it arrived.
+ */
+
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <KettleProtocol.h>
+
+#define BEACONINTERVAL         2000
+#define SETTLETIME              500
+
+struct StreamClient {
+  int fd;
+  std::string received;
+};
+
+static int connectClient(const char* host, int port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in gateway = {};
+  gateway.sin_family = AF_INET;
+  gateway.sin_port = htons(port);
+  inet_pton(AF_INET, host, &gateway.sin_addr);
+
+  if(connect(fd, (sockaddr*)&gateway, sizeof(gateway)) < 0) {
+    perror("connect");
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * @brief Sequence number from the temperature field of
+ * "BEACON,<address>,STATUS,<id>,<state>,<temperature>,...", or -1 if the
+ * beacon is not one of this run's kettles
+ */
+static long beaconSequence(const std::string &line, const std::string &prefix)
+{
+  if(line.compare(0, 7, "BEACON,") != 0) return -1;
+
+  size_t field = 0;
+  for(int commas = 0; commas < 5; commas++) {
+    field = line.find(',', field);
+    if(field == std::string::npos) return -1;
+    field++;
+    if(commas == 2 && line.compare(field, prefix.size(), prefix) != 0) return -1;
+  }
+  return strtol(line.c_str() + field, nullptr, 10);
+}
+
+int benchGateway(int argc, char **argv)
+{
+  std::string host = option(argc, argv, "--host", "127.0.0.1");
+  int port = atoi(option(argc, argv, "--port", "4300").c_str());
+  int clientCount = atoi(option(argc, argv, "--clients", "50").c_str());
+  int kettleCount = atoi(option(argc, argv, "--kettles", "500").c_str());
+  int seconds = atoi(option(argc, argv, "--seconds", "20").c_str());
+  std::string group = option(argc, argv, "--group", "239.255.42.1");
+  int beaconPort = atoi(option(argc, argv, "--beacon-port", "4211").c_str());
+  std::string keyHex = option(argc, argv, "--key", "");
+
+  uint8_t key[HMACSIZE];
+  bool signing = !keyHex.empty();
+  if(signing && !hexToBytes(keyHex.c_str(), key, HMACSIZE)) {
+    fprintf(stderr, "Key must be %d hex characters\n", HMACHEXSIZE);
+    return 1;
+  }
+  if(clientCount < 1 || kettleCount < 1 || seconds < 1) {
+    fprintf(stderr, "--clients, --kettles and --seconds must be at least 1\n");
+    return 1;
+  }
+
+  //  Kettles left over from an earlier run are still in the gateway's snapshot
+  std::string prefix = "bench" + std::to_string(getpid()) + "-";
+  std::string filter = "FILTER," + prefix + "\n";
+
+  std::vector<StreamClient> clients;
+  for(int i = 0; i < clientCount; i++) {
+    int fd = connectClient(host.c_str(), port);
+    if(fd < 0) return 1;
+    send(fd, filter.data(), filter.size(), MSG_NOSIGNAL);
+    clients.push_back({fd, ""});
+  }
+
+  int sender = socket(AF_INET, SOCK_DGRAM, 0);
+  unsigned char loop = 1;
+  setsockopt(sender, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+  sockaddr_in beaconGroup = {};
+  beaconGroup.sin_family = AF_INET;
+  beaconGroup.sin_port = htons(beaconPort);
+  if(inet_pton(AF_INET, group.c_str(), &beaconGroup.sin_addr) != 1) {
+    fprintf(stderr, "Bad group %s\n", group.c_str());
+    return 1;
+  }
+
+  printf("%d kettles, %d clients, %d s against %s:%d\n", kettleCount, clientCount, seconds, host.c_str(), port);
+  fflush(stdout);
+
+  std::vector<Clock::time_point> sentAt;
+  std::vector<double> latencies;
+  unsigned long lines = 0, unmatched = 0;
+
+  auto gap = std::chrono::microseconds((long)BEACONINTERVAL * 1000 / kettleCount);
+  Clock::time_point start = Clock::now();
+  Clock::time_point stopSending = start + std::chrono::seconds(seconds);
+  Clock::time_point stop = stopSending + std::chrono::milliseconds(SETTLETIME);
+  Clock::time_point next = start;
+
+  std::vector<pollfd> fds;
+  char buffer[65536];
+
+  while(Clock::now() < stop) {
+    while(next <= Clock::now() && next < stopSending) {
+      char beacon[200];
+      long sequence = sentAt.size();
+      int length = snprintf(beacon, sizeof(beacon), "STATUS,%s%04ld,IDLE,%ld,40.0,main,0,0,0,0,%ld",
+                            prefix.c_str(), sequence % kettleCount, sequence, sequence + 1);
+      if(signing) {
+        char mac[HMACHEXSIZE + 1];
+        hmacHex(key, beacon, length, mac);
+        length += snprintf(beacon + length, sizeof(beacon) - length, "|%s", mac);
+      }
+
+      sentAt.push_back(Clock::now());
+      sendto(sender, beacon, length, 0, (sockaddr*)&beaconGroup, sizeof(beaconGroup));
+      next += gap;
+    }
+
+    fds.clear();
+    for(StreamClient &client : clients) fds.push_back({client.fd, POLLIN, 0});
+    long wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  (next < stopSending ? next : stop) - Clock::now()).count();
+    poll(fds.data(), fds.size(), std::max(0L, wait));
+
+    for(size_t i = 0; i < clients.size(); i++) {
+      if(!(fds[i].revents & POLLIN)) continue;
+
+      ssize_t length = recv(clients[i].fd, buffer, sizeof(buffer), 0);
+      if(length <= 0) continue;
+      Clock::time_point arrived = Clock::now();
+      clients[i].received.append(buffer, length);
+
+      size_t end;
+      while((end = clients[i].received.find('\n')) != std::string::npos) {
+        long sequence = beaconSequence(clients[i].received.substr(0, end), prefix);
+        clients[i].received.erase(0, end + 1);
+
+        lines++;
+        if(sequence >= 0 && sequence < (long)sentAt.size()) latencies.push_back(msBetween(sentAt[sequence], arrived));
+        else unmatched++;
+      }
+    }
+  }
+
+  for(StreamClient &client : clients) close(client.fd);
+
+  unsigned long expected = sentAt.size() * clients.size();
+  printf("Beacons sent %zu (%.1f/s) | lines received %lu (%.1f/s) | expected %lu | unmatched %lu\n",
+         sentAt.size(), sentAt.size() / (double)seconds, lines, lines / (double)seconds, expected, unmatched);
+  printLatency("Beacon to client", latencies);
+  return 0;
+}
@@ -0,0 +1,205 @@
+/**
+ * "http" loads the kettle's web server the way several browsers would: each
+ * of --connections keeps one request in flight, opening a new connection per
+ * request unless --keep-alive is given and the server keeps it open. It
+ * reports requests per second and the latency of each request, from the start
+ * of its connection (or its write, on a kept connection) to the last byte of
+ * the response.
+ */
+
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#define REQUESTTIMEOUT         5000
+
+struct HttpConnection {
+  int fd;
+  bool connecting;
+  std::string request;
+  size_t written;
+  std::string response;
+  Clock::time_point start;
+};
+
+struct HttpStats {
+  unsigned long ok;
+  unsigned long failed;
+  unsigned long errors;
+  std::vector<double> latencies;
+};
+
+static bool httpOpen(HttpConnection &connection, const sockaddr_in &server)
+{
+  connection.fd = socket(AF_INET, SOCK_STREAM, 0);
+  fcntl(connection.fd, F_SETFL, O_NONBLOCK);
+  connection.connecting = true;
+  connection.written = 0;
+  connection.response.clear();
+  connection.start = Clock::now();
+
+  if(connect(connection.fd, (const sockaddr*)&server, sizeof(server)) == 0) connection.connecting = false;
+  else if(errno != EINPROGRESS) {
+    close(connection.fd);
+    connection.fd = -1;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Checks whether a whole response has been read
+ * @param closed the server has closed the connection
+ * @param keepOpen set when the server will take another request on it
+ */
+static bool httpComplete(const std::string &response, bool closed, bool &keepOpen)
+{
+  size_t headerEnd = response.find("\r\n\r\n");
+  if(headerEnd == std::string::npos) return false;
+
+  std::string headers = response.substr(0, headerEnd);
+  size_t body = headerEnd + 4;
+  keepOpen = strncmp(headers.c_str(), "HTTP/1.1", 8) == 0 && !strcasestr(headers.c_str(), "\r\nConnection: close");
+
+  const char* length = strcasestr(headers.c_str(), "\r\nContent-Length:");
+  if(length) return response.size() - body >= strtoul(length + 17, nullptr, 10);
+
+  if(strcasestr(headers.c_str(), "\r\nTransfer-Encoding: chunked")) {
+    return response.size() >= body + 5 && response.compare(response.size() - 5, 5, "0\r\n\r\n") == 0;
+  }
+
+  keepOpen = false;
+  return closed;
+}
+
+static void httpFinish(HttpConnection &connection, HttpStats &stats)
+{
+  stats.latencies.push_back(msBetween(connection.start, Clock::now()));
+  if(connection.response.size() > 9 && connection.response[9] == '2') stats.ok++;
+  else stats.failed++;
+}
+
+int benchHttp(int argc, char **argv)
+{
+  if(argc < 1) {
+    fprintf(stderr, "http needs <host>\n");
+    return 1;
+  }
+
+  int port = atoi(option(argc, argv, "--port", "80").c_str());
+  std::string path = option(argc, argv, "--path", "/");
+  int connectionCount = atoi(option(argc, argv, "--connections", "8").c_str());
+  int seconds = atoi(option(argc, argv, "--seconds", "10").c_str());
+  bool keepAlive = false;
+  for(int i = 0; i < argc; i++) keepAlive |= strcmp(argv[i], "--keep-alive") == 0;
+
+  sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  if(inet_pton(AF_INET, argv[0], &server.sin_addr) != 1) {
+    fprintf(stderr, "Bad address %s\n", argv[0]);
+    return 1;
+  }
+  if(connectionCount < 1 || seconds < 1) {
+    fprintf(stderr, "--connections and --seconds must be at least 1\n");
+    return 1;
+  }
+
+  std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + argv[0] + "\r\nConnection: " +
+                        (keepAlive ? "keep-alive" : "close") + "\r\n\r\n";
+
+  printf("%d connections, %d s, GET http://%s:%d%s%s\n", connectionCount, seconds, argv[0], port,
+         path.c_str(), keepAlive ? " with keep-alive" : "");
+  fflush(stdout);
+
+  HttpStats stats = {0, 0, 0, {}};
+  std::vector<HttpConnection> connections(connectionCount);
+  for(HttpConnection &connection : connections) {
+    connection.request = request;
+    if(!httpOpen(connection, server)) stats.errors++;
+  }
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point stop = start + std::chrono::seconds(seconds);
+  std::vector<pollfd> fds(connectionCount);
+  char buffer[16384];
+
+  while(Clock::now() < stop) {
+    for(int i = 0; i < connectionCount; i++) {
+      HttpConnection &connection = connections[i];
+      if(connection.fd < 0 && !httpOpen(connection, server)) stats.errors++;
+
+      short events = POLLIN;
+      if(connection.connecting || connection.written < connection.request.size()) events |= POLLOUT;
+      fds[i] = {connection.fd, events, 0};
+    }
+    poll(fds.data(), fds.size(), 100);
+
+    for(int i = 0; i < connectionCount; i++) {
+      HttpConnection &connection = connections[i];
+      if(connection.fd < 0) continue;
+      bool failed = msBetween(connection.start, Clock::now()) > REQUESTTIMEOUT;
+
+      if(!failed && connection.connecting && (fds[i].revents & (POLLOUT | POLLERR | POLLHUP))) {
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+        getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+        failed = error != 0;
+        connection.connecting = false;
+      }
+
+      if(!failed && !connection.connecting && connection.written < connection.request.size()) {
+        ssize_t written = send(connection.fd, connection.request.data() + connection.written,
+                               connection.request.size() - connection.written, MSG_NOSIGNAL);
+        if(written > 0) connection.written += written;
+        else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) failed = true;
+      }
+
+      bool closed = false;
+      if(!failed && (fds[i].revents & (POLLIN | POLLHUP))) {
+        ssize_t length = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if(length > 0) connection.response.append(buffer, length);
+        else if(length == 0) closed = true;
+        else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) failed = true;
+      }
+
+      bool keepOpen = false;
+      if(!failed && httpComplete(connection.response, closed, keepOpen)) {
+        httpFinish(connection, stats);
+        if(keepAlive && keepOpen && !closed) {
+          connection.written = 0;
+          connection.response.clear();
+          connection.start = Clock::now();
+          continue;
+        }
+      }
+      else if(!failed && !closed) continue;
+      else stats.errors++;
+
+      close(connection.fd);
+      connection.fd = -1;
+    }
+  }
+
+  for(HttpConnection &connection : connections) {
+    if(connection.fd >= 0) close(connection.fd);
+  }
+
+  double elapsed = msBetween(start, Clock::now()) / 1000.0;
+  printf("Requests %lu (%.1f/s) | 2xx %lu | other status %lu | errors %lu\n", stats.ok + stats.failed,
+         (stats.ok + stats.failed) / elapsed, stats.ok, stats.failed, stats.errors);
+  printLatency("Request", stats.latencies);
+  return 0;
+}
@@ -0,0 +1,60 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+struct Mode {
+  const char* name;
+  int (*run)(int argc, char **argv);
+  const char* usage;
+};
+
+const Mode MODES[] = {
+  {"udp", benchUdp, "udp <host> <key hex> [--port 4210] [--count 1000] [--command WIFI]"},
+  {"udp-kettle", benchUdpKettle, "udp-kettle <key hex> [--port 4210]"},
+  {"http", benchHttp, "http <host> [--port 80] [--path /] [--connections 8] [--seconds 10] [--keep-alive]"},
+  {"power", benchPower, "power [--kettles 8] [--cap 4600] [--watts 2200] [--boils 6] [--hours 24] [--rate 0.25]\n"
+                        "          [--loss 0.05] [--seed 1]"},
+  {"gateway", benchGateway, "gateway [--host 127.0.0.1] [--port 4300] [--clients 50] [--kettles 500] [--seconds 20]\n"
+                            "          [--group 239.255.42.1] [--beacon-port 4211] [--key HEX]"},
+};
+
+int main(int argc, char **argv)
+{
+  if(argc >= 2) {
+    for(const Mode &mode : MODES) {
+      if(strcmp(argv[1], mode.name) == 0) return mode.run(argc - 2, argv + 2);
+    }
+  }
+
+  fprintf(stderr, "Usage:\n");
+  for(const Mode &mode : MODES) fprintf(stderr, "  %s %s\n", argv[0], mode.usage);
+  return 1;
+}
+
+void printLatency(const char* label, std::vector<double> &milliseconds)
+{
+  if(milliseconds.empty()) {
+    printf("%s: no samples\n", label);
+    return;
+  }
+
+  std::sort(milliseconds.begin(), milliseconds.end());
+  printf("%s: %zu samples | p50 %.3f ms | p99 %.3f ms | max %.3f ms\n", label, milliseconds.size(),
+         milliseconds[milliseconds.size() / 2], milliseconds[milliseconds.size() * 99 / 100],
+         milliseconds.back());
+}
+
+double msBetween(Clock::time_point start, Clock::time_point end)
+{
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+std::string option(int argc, char **argv, const char* name, const char* fallback)
+{
+  for(int i = 0; i + 1 < argc; i++) {
+    if(strcmp(argv[i], name) == 0) return argv[i + 1];
+  }
+  return fallback;
+}
@@ -0,0 +1,246 @@
+/**
+ * "power" simulates a circuit of kettles sharing a power cap, each one running
+ * the firmware's queue and PowerSchedule code against the beacons it hears,
+ * with beacons lost at random and the rest arriving --delay ms after they are
+ * sent. Each beacon's time to target comes from a reading with --jitter
+ * degrees of noise. Requests to boil arrive at random, and each kettle only
+ * takes its next request once the last boil is done. The same requests are
+ * run again with every kettle starting as soon as it is asked, as it would
+ * with PowerCap,0, to show what the coordination costs and saves, and with
+ * the time to target advertised fresh on every beacon while queued, to show
+ * that the order kettles agree on has to be fixed when they queue.
+ */
+
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+
+#include <PowerSchedule.h>
+
+//  Must match the firmware
+#define BEACONINTERVAL         2000
+#define QUEUESETTLE            (BEACONINTERVAL * 3 / 2)
+
+#define TICK                    100
+#define AMBIENT                20.0f
+
+enum SimMode  {
+  SIM_COORDINATED,
+  SIM_LIVE_RANKING,
+  SIM_UNCOORDINATED
+};
+
+enum SimState  {
+  SIM_IDLE,
+  SIM_QUEUED,
+  SIM_HEATING
+};
+
+const char* SIM_STATE_NAMES[] = {"IDLE", "QUEUED", "HEATING"};
+
+struct SimKettle  {
+  char id[PEERIDSIZE];
+  SimState state;
+  float temperature;
+  float target;
+  unsigned long nextRequest;
+  unsigned long requested;
+  unsigned long queuedTime;
+  unsigned long beaconTime;
+  uint64_t sequence;
+  unsigned int queuedSeconds;
+  unsigned int advertisedWatts;
+  unsigned int advertisedSeconds;
+  PeerTable table;
+};
+
+//  A beacon on its way to one kettle
+struct SimDelivery  {
+  unsigned long at;
+  int to;
+  Beacon beacon;
+};
+
+struct SimResult  {
+  unsigned long boils;
+  unsigned long overCapTicks;
+  unsigned long ticks;
+  unsigned int maxDraw;
+  std::vector<double> waits;
+};
+
+struct SimSettings  {
+  int kettles;
+  unsigned int cap;
+  unsigned int watts;
+  float boilsPerHour;
+  float hours;
+  float rate;
+  float loss;
+  unsigned int delay;
+  float jitter;
+  unsigned int seed;
+};
+
+//  Time to target as the firmware works it out from one noisy reading
+static unsigned int simSeconds(const SimKettle &kettle, float rate, float noise)
+{
+  float reading = kettle.temperature + noise;
+  if(reading >= kettle.target) return 0;
+  return (kettle.target - reading) / rate;
+}
+
+static SimResult simulate(const SimSettings &settings, SimMode mode)
+{
+  std::mt19937 random(settings.seed);
+  std::exponential_distribution<double> gap(settings.boilsPerHour / 3600000.0);
+  std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+  std::normal_distribution<float> noise(0.0f, settings.jitter);
+  std::deque<SimDelivery> deliveries;
+
+  std::vector<SimKettle> kettles(settings.kettles);
+  for(int i = 0; i < settings.kettles; i++) {
+    SimKettle &kettle = kettles[i];
+    memset(&kettle.table, 0, sizeof(kettle.table));
+    snprintf(kettle.id, sizeof(kettle.id), "sim-%02d", i);
+    kettle.state = SIM_IDLE;
+    kettle.temperature = AMBIENT;
+    kettle.target = 95.0f;
+    kettle.nextRequest = gap(random);
+    kettle.beaconTime = 0UL - random() % BEACONINTERVAL;
+    kettle.sequence = 0;
+    kettle.queuedSeconds = 0;
+    kettle.advertisedWatts = 0;
+    kettle.advertisedSeconds = 0;
+  }
+
+  SimResult result = {0, 0, 0, 0, {}};
+  unsigned long end = settings.hours * 3600000.0f;
+
+  for(unsigned long now = 0; now < end; now += TICK) {
+    unsigned int draw = 0;
+
+    while(!deliveries.empty() && deliveries.front().at <= now) {
+      peerUpdate(kettles[deliveries.front().to].table, deliveries.front().beacon, now);
+      deliveries.pop_front();
+    }
+
+    for(SimKettle &kettle : kettles) {
+      if(kettle.state == SIM_IDLE && now >= kettle.nextRequest) {
+        kettle.requested = now;
+        kettle.temperature = AMBIENT + unit(random) * 10.0f;
+        kettle.target = 80.0f + unit(random) * 20.0f;
+        kettle.state = SIM_QUEUED;
+        kettle.queuedTime = now;
+        kettle.queuedSeconds = simSeconds(kettle, settings.rate, noise(random));
+        //  The firmware sends a beacon straight away when it queues
+        kettle.beaconTime = now - BEACONINTERVAL;
+      }
+
+      if(kettle.state == SIM_QUEUED) {
+        bool granted = mode == SIM_UNCOORDINATED;
+        if(!granted && kettle.advertisedWatts && now - kettle.queuedTime >= QUEUESETTLE) {
+          peerExpire(kettle.table, now);
+          PowerDemand own = {kettle.id, settings.cap, kettle.advertisedWatts, 0, kettle.advertisedSeconds};
+          granted = powerScheduled(kettle.table, own);
+        }
+        if(granted) {
+          kettle.state = SIM_HEATING;
+          //  And again when it starts heating
+          kettle.beaconTime = now - BEACONINTERVAL;
+          result.waits.push_back(now - kettle.requested);
+        }
+      }
+
+      if(kettle.state == SIM_HEATING) {
+        draw += settings.watts;
+        kettle.temperature += settings.rate * TICK / 1000.0f;
+        if(kettle.temperature >= kettle.target) {
+          kettle.state = SIM_IDLE;
+          kettle.nextRequest = now + gap(random);
+          result.boils++;
+        }
+      }
+    }
+
+    for(SimKettle &kettle : kettles) {
+      if(now - kettle.beaconTime < BEACONINTERVAL) continue;
+      kettle.beaconTime = now;
+
+      Beacon beacon = {};
+      strcpy(beacon.id, kettle.id);
+      strcpy(beacon.state, SIM_STATE_NAMES[kettle.state]);
+      strcpy(beacon.circuit, "main");
+      beacon.temperature = kettle.temperature;
+      beacon.target = kettle.target;
+      beacon.cap = settings.cap;
+      beacon.sequence = ++kettle.sequence;
+      kettle.advertisedWatts = kettle.state == SIM_IDLE ? 0 : settings.watts;
+      kettle.advertisedSeconds = simSeconds(kettle, settings.rate, noise(random));
+      if(kettle.state == SIM_QUEUED && mode != SIM_LIVE_RANKING) kettle.advertisedSeconds = kettle.queuedSeconds;
+      beacon.watts = kettle.advertisedWatts;
+      beacon.secondsToTarget = kettle.advertisedSeconds;
+
+      for(int i = 0; i < settings.kettles; i++) {
+        if(&kettles[i] == &kettle || unit(random) < settings.loss) continue;
+        deliveries.push_back({now + settings.delay, i, beacon});
+      }
+    }
+
+    result.ticks++;
+    if(draw > settings.cap) result.overCapTicks++;
+    if(draw > result.maxDraw) result.maxDraw = draw;
+  }
+
+  return result;
+}
+
+static void simReport(const char* label, const SimSettings &settings, SimResult &result)
+{
+  printf("%s: boils/hour %.1f | over cap %.2f%% of the time | peak %u W\n", label,
+         result.boils / settings.hours, result.overCapTicks * 100.0 / result.ticks, result.maxDraw);
+
+  std::string waitLabel = std::string(label) + " wait to heat";
+  printLatency(waitLabel.c_str(), result.waits);
+}
+
+int benchPower(int argc, char **argv)
+{
+  SimSettings settings;
+  settings.kettles = atoi(option(argc, argv, "--kettles", "8").c_str());
+  settings.cap = atoi(option(argc, argv, "--cap", "4600").c_str());
+  settings.watts = atoi(option(argc, argv, "--watts", "2200").c_str());
+  settings.boilsPerHour = atof(option(argc, argv, "--boils", "6").c_str());
+  settings.hours = atof(option(argc, argv, "--hours", "24").c_str());
+  settings.rate = atof(option(argc, argv, "--rate", "0.25").c_str());
+  settings.loss = atof(option(argc, argv, "--loss", "0.05").c_str());
+  settings.delay = atoi(option(argc, argv, "--delay", "300").c_str());
+  settings.jitter = atof(option(argc, argv, "--jitter", "0.5").c_str());
+  settings.seed = atoi(option(argc, argv, "--seed", "1").c_str());
+
+  if(settings.kettles < 1 || !settings.cap || !settings.watts || settings.boilsPerHour <= 0 ||
+     settings.hours <= 0 || settings.rate <= 0 || settings.loss < 0 || settings.loss >= 1 ||
+     settings.jitter < 0 || settings.delay >= BEACONINTERVAL) {
+    fprintf(stderr, "Kettles, cap, watts, boils, hours and rate must be positive, loss in [0, 1), "
+                    "jitter not negative and delay under %d ms\n", BEACONINTERVAL);
+    return 1;
+  }
+
+  printf("%d kettles of %u W on a %u W cap, %.1f boils/hour each, %.2f C/s, %.0f%% beacons lost, "
+         "%u ms delay, %.2f C jitter, %.1f h\n", settings.kettles, settings.watts, settings.cap,
+         settings.boilsPerHour, settings.rate, settings.loss * 100, settings.delay, settings.jitter, settings.hours);
+  if(settings.kettles > MAXPEERS + 1) printf("More kettles than the peer table holds, power is refused while it overflows\n");
+
+  SimResult coordinated = simulate(settings, SIM_COORDINATED);
+  SimResult live = simulate(settings, SIM_LIVE_RANKING);
+  SimResult uncoordinated = simulate(settings, SIM_UNCOORDINATED);
+  simReport("Coordinated", settings, coordinated);
+  simReport("Live ranking", settings, live);
+  simReport("Uncoordinated", settings, uncoordinated);
+  return 0;
+}
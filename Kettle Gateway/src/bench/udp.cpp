@@ -0,0 +1,170 @@
+/**
+ * "udp" sends signed commands to a kettle's UDP control port one at a time and
+ * times each until its signed ACK arrives, the command-to-acknowledgement latency.
+ * The ACK is sent once the command has changed the kettle's state, the relay
+ * itself follows on the next pass of the state machine.
+ *
+ * "udp-kettle" is a loopback stand-in for the kettle's control port: it checks
+ * and rejects packets with the same KettleProtocol code as the firmware, and
+ * acknowledges every accepted command with "ACK,<counter>".
+ */
+
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <KettleProtocol.h>
+
+#define UDPMAXPACKET            200
+#define REPLYTIMEOUT           1000
+
+static bool readKey(const char* hex, uint8_t key[HMACSIZE])
+{
+  if(hexToBytes(hex, key, HMACSIZE)) return true;
+  fprintf(stderr, "Key must be %d hex characters\n", HMACHEXSIZE);
+  return false;
+}
+
+static std::string signedMessage(const uint8_t* key, const std::string &message)
+{
+  char mac[HMACHEXSIZE + 1];
+  hmacHex(key, message.c_str(), message.size(), mac);
+  return message + "|" + mac;
+}
+
+int benchUdp(int argc, char **argv)
+{
+  if(argc < 2) {
+    fprintf(stderr, "udp needs <host> <key hex>\n");
+    return 1;
+  }
+
+  uint8_t key[HMACSIZE];
+  if(!readKey(argv[1], key)) return 1;
+
+  int port = atoi(option(argc, argv, "--port", "4210").c_str());
+  int count = atoi(option(argc, argv, "--count", "1000").c_str());
+  std::string command = option(argc, argv, "--command", "WIFI");
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in kettle = {};
+  kettle.sin_family = AF_INET;
+  kettle.sin_port = htons(port);
+  if(inet_pton(AF_INET, argv[0], &kettle.sin_addr) != 1) {
+    fprintf(stderr, "Bad address %s\n", argv[0]);
+    return 1;
+  }
+
+  timeval timeout = {REPLYTIMEOUT / 1000, (REPLYTIMEOUT % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  //  Millisecond timestamps keep counting up across runs and kettle reboots
+  uint64_t counter = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch()).count();
+
+  std::vector<double> latencies;
+  int lost = 0, errors = 0, badSignatures = 0;
+
+  for(int i = 0; i < count; i++) {
+    counter++;
+    std::string packet = signedMessage(key, std::to_string(counter) + ":" + command);
+
+    Clock::time_point start = Clock::now();
+    sendto(fd, packet.data(), packet.size(), 0, (sockaddr*)&kettle, sizeof(kettle));
+
+    char reply[UDPMAXPACKET * 4];
+    ssize_t length = recv(fd, reply, sizeof(reply) - 1, 0);
+    Clock::time_point end = Clock::now();
+
+    if(length <= 0) {
+      lost++;
+      continue;
+    }
+    reply[length] = '\0';
+
+    char* mac = strrchr(reply, '|');
+    if(!mac || (*mac = '\0', !hmacMatches(key, reply, strlen(reply), mac + 1))) {
+      badSignatures++;
+      continue;
+    }
+
+    if(strncmp(reply, "ERR,", 4) == 0) {
+      errors++;
+      //  A REPLAY error says where the kettle's counter is, carry on after it
+      const char* last = strstr(reply, ",REPLAY,");
+      if(last) counter = strtoull(last + 8, nullptr, 10);
+      continue;
+    }
+
+    latencies.push_back(msBetween(start, end));
+  }
+
+  printf("Sent %d | acked %zu | errors %d | lost %d | bad signatures %d\n",
+         count, latencies.size(), errors, lost, badSignatures);
+  printLatency("Command to ACK", latencies);
+  return 0;
+}
+
+int benchUdpKettle(int argc, char **argv)
+{
+  if(argc < 1) {
+    fprintf(stderr, "udp-kettle needs <key hex>\n");
+    return 1;
+  }
+
+  uint8_t key[HMACSIZE];
+  if(!readKey(argv[0], key)) return 1;
+  int port = atoi(option(argc, argv, "--port", "4210").c_str());
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(bind(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+    perror("bind");
+    return 1;
+  }
+
+  printf("Stand-in kettle on 127.0.0.1:%d\n", port);
+  fflush(stdout);
+
+  CounterWindow window = {0, 0};
+  unsigned long reservations = 0;
+
+  while(true) {
+    char packet[UDPMAXPACKET + 1];
+    sockaddr_in from;
+    socklen_t fromLength = sizeof(from);
+    ssize_t length = recvfrom(fd, packet, UDPMAXPACKET, 0, (sockaddr*)&from, &fromLength);
+    if(length <= 0) continue;
+    packet[length] = '\0';
+
+    uint64_t counter;
+    UdpVerdict verdict = udpVerify(packet, key, window.last, counter);
+    if(verdict == UDP_UNSIGNED || verdict == UDP_FORGED) continue;
+
+    char rejected[UDPREPLYSIZE + 1];
+    std::string reply;
+    if(udpReply(verdict, counter, window.last, rejected)) reply = rejected;
+    else {
+      if(counterAccept(window, counter) && ++reservations % 100 == 0) {
+        printf("%lu counter reservations written\n", reservations);
+        fflush(stdout);
+      }
+      reply = "ACK," + std::to_string(counter);
+    }
+
+    reply = signedMessage(key, reply);
+    sendto(fd, reply.data(), reply.size(), 0, (sockaddr*)&from, fromLength);
+  }
+}
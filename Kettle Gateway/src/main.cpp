@@ -0,0 +1,901 @@
+/**
+ * Kettle Gateway
+ *
+ * Collects the status beacons every kettle multicasts on the local network
+ * and fans them out as one merged stream, so dashboards open a single
+ * connection here instead of one to every kettle.
+ *
+ * Kettles are found by browsing their _kettle._udp mDNS record every
+ * DISCOVERYINTERVAL, whose TXT entries give the kettle id and the beacon
+ * group to join. The firmware's default group is joined from the start.
+ *
+ * Downstream clients connect over TCP and receive one line per update:
+ *  BEACON,<address>,<beacon>     the kettle's beacon exactly as sent, signature included,
+ *                                so a client holding the kettle key can check it itself
+ *  LOST,<id>                     kettle missed KETTLETIMEOUT of beacons
+ *  REPLY,<id>,<reply>            the kettle's signed ACK or ERR to a COMMAND, or an
+ *                                unsigned ERR,<counter>,NOKEY|NOKETTLE|DENIED|TIMEOUT from here
+ *  CHALLENGE,<nonce>             sent on connecting when the gateway has a client key
+ *  AUTH,OK|DENIED                answer to AUTH, DENIED is followed by a new CHALLENGE
+ * where a beacon is
+ *  STATUS,<id>,<state>,<temperature>,<target>,<circuit>,<cap>,<watts>,<priority>,<seconds to target>,<sequence>[|<hmac>]
+ * and may send:
+ *  FILTER,<id>,<id>...           only receive kettles whose id starts with one of these
+ *  FILTER                        receive every kettle again
+ *  LIST                          resend the current status of every matching kettle
+ *  AUTH,<hmac>                   lower case hex HMAC-SHA256 of the nonce with the client key
+ *  COMMAND,<id>,<command>        sign command and send it to the kettle's UDP control port
+ *
+ * A beacon is only passed on when its sequence is above the last one heard
+ * from that kettle, remembered after it is LOST too. "--key HEX" makes the
+ * gateway check beacons itself and drop any that are unsigned or forged, so
+ * nothing on the network can inject a fake kettle or play back an old beacon
+ * of a kettle the gateway has already heard.
+ * Commands are only passed on when the gateway has the key to sign them.
+ *
+ * Anything the gateway signs is trusted by the kettle, so only authenticated
+ * clients may send commands: with "--client-key HEX" a client has to answer
+ * its CHALLENGE first, without one only clients on this machine may. Clients
+ * are served on 127.0.0.1 unless "--listen ADDRESS" is given. Commands that
+ * change a kettle's key, network or power budget are never passed on, they
+ * have to be made at the kettle itself.
+ *
+ * "--simulate N" runs N fake kettles instead, for load testing, signing their
+ * beacons when a key is given.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <KettleProtocol.h>
+#include <PowerSchedule.h>
+
+//  Must match the beacon settings in the kettle firmware
+#define BEACONPORT             4211
+#define BEACONGROUP  "239.255.42.1"
+#define BEACONINTERVAL         2000
+#define CONTROLPORT            4210
+
+#define MDNSPORT               5353
+#define MDNSGROUP     "224.0.0.251"
+#define KETTLESERVICE "_kettle._udp.local"
+#define DISCOVERYINTERVAL     30000
+
+#define COMMANDTIMEOUT         2000
+
+#define GATEWAYPORT            4300
+#define KETTLETIMEOUT          6000
+#define MAXPACKET               512
+#define MAXCLIENTBUFFER       65536
+#define STATSINTERVAL         10000
+#define NONCESIZE                16
+
+using Clock = std::chrono::steady_clock;
+
+struct Kettle {
+  std::string status;
+  std::string fields;
+  sockaddr_in address;
+  Clock::time_point lastSeen;
+};
+
+//  A command sent to a kettle and waiting on its ACK
+struct Command {
+  int client;
+  std::string id;
+  std::string command;
+  Clock::time_point sent;
+  bool retried;
+};
+
+struct Client {
+  int fd;
+  bool authenticated;
+  std::string challenge;
+  std::vector<std::string> filters;
+  std::string received;
+  std::string pending;
+};
+
+std::map<std::string, Kettle> kettles;
+
+//  Sequence of the last beacon passed on, by kettle id
+std::map<std::string, uint64_t> beaconSequences;
+std::map<int, Client> clients;
+
+//  Beacon sockets by port, each joined to every group announced on that port
+std::map<int, int> beaconSockets;
+std::vector<std::string> beaconGroups;
+
+//  Control port addresses learnt from mDNS, by kettle id
+std::map<std::string, sockaddr_in> controlAddresses;
+
+std::map<uint64_t, Command> commands;
+uint64_t commandCounter = 0;
+
+uint8_t kettleKey[HMACSIZE];
+bool kettleKeyLoaded = false;
+
+//  Shared with the dashboards allowed to send commands
+uint8_t clientKey[HMACSIZE];
+bool clientKeyLoaded = false;
+
+//  Commands only ever taken from the kettle's own setup page or a key holder talking to it directly
+const char* GATEWAY_REFUSED[] = {"UdpKey", "RESET", "AccessPoint", "Circuit", "PowerCap", "PowerRating"};
+
+//  Counters for the stats line, reset every STATSINTERVAL
+unsigned long beaconsIn = 0;
+unsigned long linesOut = 0;
+unsigned long beaconsDropped = 0;
+
+/**
+ * Forward Decleartion
+ */
+int beaconSocket(int port);
+bool beaconJoin(const std::string &group, int port);
+int listenSocket(const char* address, int port);
+int udpSocket();
+void beaconHandle(int fd);
+void discoverySend(int fd);
+void discoveryHandle(int fd);
+bool dnsName(const uint8_t* message, size_t length, size_t &offset, std::string &name);
+void commandSend(Client &client, int fd, const std::string &line);
+void commandForward(int fd, uint64_t counter, Command &command);
+void replyHandle(int fd);
+bool beaconTrusted(const char* packet, size_t length);
+void acceptHandle(int fd);
+bool clientRead(int fd, Client &client, int control);
+bool clientWrite(int fd, Client &client);
+void commandHandle(Client &client, int control, const std::string &command);
+void challengeSend(Client &client);
+void authHandle(Client &client, const std::string &answer);
+bool commandAllowed(const std::string &command);
+void sendTo(Client &client, const std::string &id, const std::string &line);
+void broadcast(const std::string &id, const std::string &line);
+void expireHandle();
+void statsHandle();
+int runGateway(const char* address, int port);
+int runSimulation(int count);
+long msSince(Clock::time_point since);
+
+int main(int argc, char **argv)
+{
+  int port = GATEWAYPORT;
+  const char* address = "127.0.0.1";
+  int simulate = 0;
+
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) simulate = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--port") == 0 && i + 1 < argc) port = atoi(argv[++i]);
+    else if(strcmp(argv[i], "--listen") == 0 && i + 1 < argc) address = argv[++i];
+    else if(strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+      kettleKeyLoaded = hexToBytes(argv[++i], kettleKey, HMACSIZE);
+      if(!kettleKeyLoaded) {
+        fprintf(stderr, "Key must be %d hex characters\n", HMACHEXSIZE);
+        return 1;
+      }
+    }
+    else if(strcmp(argv[i], "--client-key") == 0 && i + 1 < argc) {
+      clientKeyLoaded = hexToBytes(argv[++i], clientKey, HMACSIZE);
+      if(!clientKeyLoaded) {
+        fprintf(stderr, "Client key must be %d hex characters\n", HMACHEXSIZE);
+        return 1;
+      }
+    }
+    else {
+      fprintf(stderr, "Usage: %s [--listen ADDRESS] [--port N] [--key HEX] [--client-key HEX] [--simulate KETTLES]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  //  A dashboard resetting its connection must not take the gateway down
+  signal(SIGPIPE, SIG_IGN);
+
+  if(simulate > 0) return runSimulation(simulate);
+  return runGateway(address, port);
+}
+
+int runGateway(const char* address, int port)
+{
+  int server = listenSocket(address, port);
+  int discovery = udpSocket();
+  int control = udpSocket();
+  if(!beaconJoin(BEACONGROUP, BEACONPORT) || server < 0 || discovery < 0 || control < 0) return 1;
+
+  printf("Clients on %s:%d, beacons %s, commands %s\n", address, port,
+         kettleKeyLoaded ? "checked" : "passed on unchecked",
+         !kettleKeyLoaded ? "refused" : clientKeyLoaded ? "signed for authenticated clients" : "signed for local clients");
+
+  Clock::time_point lastStats = Clock::now();
+  Clock::time_point lastDiscovery = Clock::now();
+  discoverySend(discovery);
+  std::vector<pollfd> fds;
+
+  while(true) {
+    fds.clear();
+    fds.push_back({server, POLLIN, 0});
+    fds.push_back({discovery, POLLIN, 0});
+    fds.push_back({control, POLLIN, 0});
+    for(auto &beacons : beaconSockets) fds.push_back({beacons.second, POLLIN, 0});
+    size_t firstClient = fds.size();
+    for(auto &client : clients) {
+      short events = POLLIN;
+      if(!client.second.pending.empty()) events |= POLLOUT;
+      fds.push_back({client.first, events, 0});
+    }
+
+    if(poll(fds.data(), fds.size(), 1000) < 0) {
+      perror("poll");
+      return 1;
+    }
+
+    if(fds[0].revents & POLLIN) acceptHandle(server);
+    if(fds[1].revents & POLLIN) discoveryHandle(discovery);
+    if(fds[2].revents & POLLIN) replyHandle(control);
+    for(size_t i = 3; i < firstClient; i++) {
+      if(fds[i].revents & POLLIN) beaconHandle(fds[i].fd);
+    }
+
+    for(size_t i = firstClient; i < fds.size(); i++) {
+      auto client = clients.find(fds[i].fd);
+      bool open = true;
+      if(fds[i].revents & (POLLERR | POLLHUP)) open = false;
+      if(open && (fds[i].revents & POLLIN)) open = clientRead(fds[i].fd, client->second, control);
+      if(open && (fds[i].revents & POLLOUT)) open = clientWrite(fds[i].fd, client->second);
+      if(open && client->second.pending.size() > MAXCLIENTBUFFER) open = false;
+
+      if(!open) {
+        close(fds[i].fd);
+        clients.erase(client);
+        for(auto &command : commands) {
+          if(command.second.client == fds[i].fd) command.second.client = -1;
+        }
+      }
+    }
+
+    expireHandle();
+
+    if(msSince(lastDiscovery) >= DISCOVERYINTERVAL) {
+      lastDiscovery = Clock::now();
+      discoverySend(discovery);
+    }
+
+    if(msSince(lastStats) >= STATSINTERVAL) {
+      lastStats = Clock::now();
+      statsHandle();
+    }
+  }
+}
+
+/**
+ * @brief Opens a UDP socket for beacons
+ * @param port bind to this port to receive, 0 to only send
+ * @return socket, -1 on failure
+ */
+int beaconSocket(int port)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  unsigned char loop = 1;
+  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+
+  if(port == 0) return fd;
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  if(bind(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+    perror("bind beacon port");
+    close(fd);
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * @brief Joins a beacon group, opening a socket for its port if needed
+ * @return false if the group could not be joined
+ */
+bool beaconJoin(const std::string &group, int port)
+{
+  std::string name = group + ":" + std::to_string(port);
+  if(std::find(beaconGroups.begin(), beaconGroups.end(), name) != beaconGroups.end()) return true;
+
+  if(!beaconSockets.count(port)) {
+    int fd = beaconSocket(port);
+    if(fd < 0) return false;
+    beaconSockets[port] = fd;
+  }
+
+  ip_mreq membership = {};
+  membership.imr_interface.s_addr = htonl(INADDR_ANY);
+  if(inet_pton(AF_INET, group.c_str(), &membership.imr_multiaddr) != 1 ||
+     setsockopt(beaconSockets[port], IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+    fprintf(stderr, "Could not join beacon group %s\n", name.c_str());
+    return false;
+  }
+
+  beaconGroups.push_back(name);
+  printf("Joined beacon group %s\n", name.c_str());
+  fflush(stdout);
+  return true;
+}
+
+//  Unbound non-blocking UDP socket, for mDNS queries and kettle commands
+int udpSocket()
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+int listenSocket(const char* host, int port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  if(inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+    fprintf(stderr, "Bad listen address %s\n", host);
+    close(fd);
+    return -1;
+  }
+  if(bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 128) < 0) {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * @brief Reads every waiting beacon, a kettle is only sent on to clients
+ * when its beacon has changed since the last one. Beacons are passed on
+ * untouched so the signature still covers them, and dropped when they do
+ * not read or are not newer than the kettle's last
+ */
+void beaconHandle(int fd)
+{
+  char packet[MAXPACKET + 1];
+  sockaddr_in from;
+  socklen_t fromLength = sizeof(from);
+  ssize_t length;
+
+  while((length = recvfrom(fd, packet, MAXPACKET, 0, (sockaddr*)&from, &fromLength)) > 0) {
+    packet[length] = '\0';
+    beaconsIn++;
+
+    if(strncmp(packet, "STATUS,", 7) != 0 || !beaconTrusted(packet, length)) {
+      beaconsDropped++;
+      continue;
+    }
+
+    const char* mac = strrchr(packet, '|');
+    std::string body(packet, mac ? mac - packet : length);
+    Beacon beacon;
+    if(!beaconParse(body.c_str(), beacon)) {
+      beaconsDropped++;
+      continue;
+    }
+
+    std::string id = beacon.id;
+    auto last = beaconSequences.find(id);
+    if(last != beaconSequences.end() && beacon.sequence <= last->second) {
+      beaconsDropped++;
+      continue;
+    }
+    beaconSequences[id] = beacon.sequence;
+
+    std::string address = inet_ntoa(from.sin_addr);
+    std::string status = "BEACON," + address + "," + packet;
+
+    //  Every beacon has a new sequence, only the address and the fields before it count as a change
+    std::string fields = address + "," + body.substr(0, body.rfind(','));
+
+    Kettle &kettle = kettles[id];
+    kettle.address = from;
+    kettle.lastSeen = Clock::now();
+    kettle.status = status;
+    if(kettle.fields == fields) continue;
+    kettle.fields = fields;
+
+    broadcast(id, status);
+  }
+}
+
+//  Every beacon is trusted until the gateway is given the key to check them
+bool beaconTrusted(const char* packet, size_t length)
+{
+  if(!kettleKeyLoaded) return true;
+
+  //  A NUL inside the packet would hide the rest of it from the check
+  const char* mac = strrchr(packet, '|');
+  if(!mac || strlen(packet) != length) return false;
+  return hmacMatches(kettleKey, packet, mac - packet, mac + 1);
+}
+
+//  Asks every kettle for its _kettle._udp record, answers come back to this socket
+void discoverySend(int fd)
+{
+  uint8_t query[64] = {0};
+  query[5] = 1;
+  size_t length = 12;
+
+  const char* service = KETTLESERVICE;
+  while(*service) {
+    const char* dot = strchr(service, '.');
+    size_t label = dot ? (size_t)(dot - service) : strlen(service);
+    query[length++] = label;
+    memcpy(query + length, service, label);
+    length += label;
+    service += label + (dot ? 1 : 0);
+  }
+  query[length++] = 0;
+
+  //  PTR, class IN with the unicast response bit set
+  const uint8_t question[] = {0x00, 0x0c, 0x80, 0x01};
+  memcpy(query + length, question, sizeof(question));
+  length += sizeof(question);
+
+  sockaddr_in group = {};
+  group.sin_family = AF_INET;
+  group.sin_port = htons(MDNSPORT);
+  inet_pton(AF_INET, MDNSGROUP, &group.sin_addr);
+  sendto(fd, query, length, 0, (sockaddr*)&group, sizeof(group));
+}
+
+/**
+ * @brief Reads mDNS answers, joining the beacon group each kettle gives in
+ * its TXT record and remembering its control port from the SRV record
+ */
+void discoveryHandle(int fd)
+{
+  uint8_t message[1500];
+  sockaddr_in from;
+  socklen_t fromLength = sizeof(from);
+  ssize_t length;
+
+  while((length = recvfrom(fd, message, sizeof(message), 0, (sockaddr*)&from, &fromLength)) > 0) {
+    if(length < 12 || !(message[2] & 0x80)) continue;
+
+    unsigned questions = message[4] << 8 | message[5];
+    unsigned records = (message[6] << 8 | message[7]) + (message[8] << 8 | message[9]) +
+                       (message[10] << 8 | message[11]);
+
+    size_t offset = 12;
+    std::string name;
+    bool valid = true;
+    for(unsigned i = 0; i < questions && valid; i++) {
+      valid = dnsName(message, length, offset, name) && (offset += 4) <= (size_t)length;
+    }
+
+    std::map<std::string, std::map<std::string, std::string>> texts;
+    std::map<std::string, int> ports;
+
+    for(unsigned i = 0; i < records && valid; i++) {
+      if(!dnsName(message, length, offset, name) || offset + 10 > (size_t)length) break;
+      unsigned type = message[offset] << 8 | message[offset + 1];
+      size_t dataLength = message[offset + 8] << 8 | message[offset + 9];
+      offset += 10;
+      if(offset + dataLength > (size_t)length) break;
+
+      if(type == 33 && dataLength >= 6) {
+        ports[name] = message[offset + 4] << 8 | message[offset + 5];
+      }
+      else if(type == 16) {
+        for(size_t at = offset; at < offset + dataLength; at += 1 + message[at]) {
+          std::string entry((const char*)message + at + 1, std::min<size_t>(message[at], offset + dataLength - at - 1));
+          size_t equals = entry.find('=');
+          if(equals != std::string::npos) texts[name][entry.substr(0, equals)] = entry.substr(equals + 1);
+        }
+      }
+      offset += dataLength;
+    }
+
+    for(auto &text : texts) {
+      const std::string &instance = text.first;
+      const std::string suffix = "." KETTLESERVICE;
+      if(instance.size() <= suffix.size() ||
+         strcasecmp(instance.c_str() + instance.size() - suffix.size(), suffix.c_str()) != 0) continue;
+
+      std::string beacon = text.second["beacon"];
+      size_t colon = beacon.find(':');
+      if(colon != std::string::npos) beaconJoin(beacon.substr(0, colon), atoi(beacon.c_str() + colon + 1));
+
+      std::string id = text.second["id"];
+      if(!id.empty() && ports.count(instance)) {
+        sockaddr_in control = from;
+        control.sin_port = htons(ports[instance]);
+        controlAddresses[id] = control;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Reads a possibly compressed DNS name at offset
+ * @param offset moved past the name
+ * @return false if the name runs off the message or loops
+ */
+bool dnsName(const uint8_t* message, size_t length, size_t &offset, std::string &name)
+{
+  name.clear();
+  size_t at = offset;
+  bool jumped = false;
+  int jumps = 0;
+
+  while(true) {
+    if(at >= length) return false;
+    uint8_t label = message[at];
+
+    if(label == 0) {
+      at++;
+      break;
+    }
+    if((label & 0xc0) == 0xc0) {
+      if(at + 1 >= length || ++jumps > 16) return false;
+      if(!jumped) offset = at + 2;
+      jumped = true;
+      at = (label & 0x3f) << 8 | message[at + 1];
+      continue;
+    }
+    if(label > 63 || at + 1 + label > length) return false;
+
+    if(!name.empty()) name += '.';
+    name.append((const char*)message + at + 1, label);
+    at += 1 + label;
+  }
+
+  if(!jumped) offset = at;
+  return true;
+}
+
+/**
+ * @brief Takes new clients. With a client key each one is sent a fresh nonce
+ * to sign, otherwise only clients connecting from this machine may command
+ */
+void acceptHandle(int fd)
+{
+  int client;
+  sockaddr_in from;
+  socklen_t fromLength = sizeof(from);
+
+  while((client = accept(fd, (sockaddr*)&from, &fromLength)) >= 0) {
+    fcntl(client, F_SETFL, O_NONBLOCK);
+    Client &added = clients[client] = Client();
+    added.fd = client;
+    added.authenticated = !clientKeyLoaded && (ntohl(from.sin_addr.s_addr) >> 24) == 127;
+
+    if(clientKeyLoaded) challengeSend(added);
+
+    for(auto &kettle : kettles) sendTo(added, kettle.first, kettle.second.status);
+    fromLength = sizeof(from);
+  }
+}
+
+bool clientRead(int fd, Client &client, int control)
+{
+  char buffer[MAXPACKET];
+  ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+  if(length < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  if(length == 0) return false;
+
+  client.received.append(buffer, length);
+  if(client.received.size() > MAXCLIENTBUFFER) return false;
+
+  size_t end;
+  while((end = client.received.find('\n')) != std::string::npos) {
+    std::string command = client.received.substr(0, end);
+    client.received.erase(0, end + 1);
+    if(!command.empty() && command.back() == '\r') command.pop_back();
+    commandHandle(client, control, command);
+  }
+  return true;
+}
+
+bool clientWrite(int fd, Client &client)
+{
+  ssize_t written = send(fd, client.pending.data(), client.pending.size(), MSG_NOSIGNAL);
+  if(written < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  client.pending.erase(0, written);
+  return true;
+}
+
+void commandHandle(Client &client, int control, const std::string &command)
+{
+  if(command == "FILTER" || command.compare(0, 7, "FILTER,") == 0) {
+    client.filters.clear();
+    size_t start = 7;
+    while(start < command.size()) {
+      size_t end = command.find(',', start);
+      if(end == std::string::npos) end = command.size();
+      if(end > start) client.filters.push_back(command.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+  else if(command == "LIST") {
+    for(auto &kettle : kettles) sendTo(client, kettle.first, kettle.second.status);
+  }
+  else if(command.compare(0, 5, "AUTH,") == 0) {
+    authHandle(client, command.substr(5));
+  }
+  else if(command.compare(0, 8, "COMMAND,") == 0) {
+    commandSend(client, control, command);
+  }
+}
+
+void challengeSend(Client &client)
+{
+  static std::random_device random;
+  char nonce[NONCESIZE * 2 + 1];
+  for(int i = 0; i < NONCESIZE; i++) snprintf(nonce + i * 2, 3, "%02x", (unsigned)(random() & 0xff));
+
+  client.challenge = nonce;
+  client.pending += "CHALLENGE," + client.challenge + "\n";
+}
+
+//  Checks the client's HMAC of its nonce, each nonce can only be answered once
+void authHandle(Client &client, const std::string &answer)
+{
+  bool matches = !client.challenge.empty() && answer.size() == HMACHEXSIZE &&
+                 hmacMatches(clientKey, client.challenge.data(), client.challenge.size(), answer.c_str());
+  client.challenge.clear();
+
+  if(matches) {
+    client.authenticated = true;
+    client.pending += "AUTH,OK\n";
+    return;
+  }
+  client.pending += "AUTH,DENIED\n";
+  if(clientKeyLoaded && !client.authenticated) challengeSend(client);
+}
+
+//  False for commands in GATEWAY_REFUSED, whether or not they have a parameter
+bool commandAllowed(const std::string &command)
+{
+  std::string property = command.substr(0, command.find(','));
+  for(const char* refused : GATEWAY_REFUSED) {
+    if(property.compare(0, strlen(refused), refused) == 0) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Signs "COMMAND,<id>,<command>" from a client and sends it to the
+ * kettle, the reply is passed back by replyHandle
+ */
+void commandSend(Client &client, int fd, const std::string &line)
+{
+  size_t idEnd = line.find(',', 8);
+  if(idEnd == std::string::npos) return;
+  std::string id = line.substr(8, idEnd - 8);
+
+  if(!kettleKeyLoaded) {
+    client.pending += "REPLY," + id + ",ERR,0,NOKEY\n";
+    return;
+  }
+  if(!client.authenticated || !commandAllowed(line.substr(idEnd + 1))) {
+    client.pending += "REPLY," + id + ",ERR,0,DENIED\n";
+    return;
+  }
+  if(!kettles.count(id)) {
+    client.pending += "REPLY," + id + ",ERR,0,NOKETTLE\n";
+    return;
+  }
+
+  //  Millisecond timestamps keep counting up across gateway restarts
+  uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count();
+  commandCounter = std::max(commandCounter + 1, now);
+
+  Command &command = commands[commandCounter];
+  command = {client.fd, id, line.substr(idEnd + 1), Clock::now(), false};
+
+  commandForward(fd, commandCounter, command);
+}
+
+void commandForward(int fd, uint64_t counter, Command &command)
+{
+  std::string packet = std::to_string(counter) + ":" + command.command;
+  char mac[HMACHEXSIZE + 1];
+  hmacHex(kettleKey, packet.c_str(), packet.size(), mac);
+  packet += "|";
+  packet += mac;
+
+  //  The mDNS record gives the control port, otherwise the firmware default at the beacon's address
+  sockaddr_in kettle;
+  if(controlAddresses.count(command.id)) kettle = controlAddresses[command.id];
+  else {
+    kettle = kettles[command.id].address;
+    kettle.sin_port = htons(CONTROLPORT);
+  }
+  sendto(fd, packet.data(), packet.size(), 0, (sockaddr*)&kettle, sizeof(kettle));
+}
+
+/**
+ * @brief Passes signed kettle replies back to the client that sent the
+ * command. A REPLAY error, after the kettle kept a newer counter, is retried
+ * once from the counter it gives
+ */
+void replyHandle(int fd)
+{
+  char packet[MAXPACKET + 1];
+  ssize_t length;
+
+  while((length = recv(fd, packet, MAXPACKET, 0)) > 0) {
+    packet[length] = '\0';
+    std::string reply = packet;
+
+    char* mac = strrchr(packet, '|');
+    if(!mac || strlen(packet) != (size_t)length) continue;
+    *mac = '\0';
+    if(!hmacMatches(kettleKey, packet, strlen(packet), mac + 1)) continue;
+
+    bool error = strncmp(packet, "ERR,", 4) == 0;
+    if(!error && strncmp(packet, "ACK,", 4) != 0) continue;
+
+    auto command = commands.find(strtoull(packet + 4, nullptr, 10));
+    if(command == commands.end()) continue;
+
+    const char* replay = strstr(packet, ",REPLAY,");
+    if(error && replay && !command->second.retried) {
+      Command retry = command->second;
+      retry.retried = true;
+      commands.erase(command);
+
+      commandCounter = std::max(commandCounter, (uint64_t)strtoull(replay + 8, nullptr, 10)) + 1;
+      commands[commandCounter] = retry;
+      commandForward(fd, commandCounter, commands[commandCounter]);
+      continue;
+    }
+
+    auto client = clients.find(command->second.client);
+    if(client != clients.end()) client->second.pending += "REPLY," + command->second.id + "," + reply + "\n";
+    commands.erase(command);
+  }
+}
+
+//  Queues a line for one client if it passes the client's filters
+void sendTo(Client &client, const std::string &id, const std::string &line)
+{
+  if(!client.filters.empty()) {
+    bool match = std::any_of(client.filters.begin(), client.filters.end(),
+      [&id](const std::string &filter) { return id.compare(0, filter.size(), filter) == 0; });
+    if(!match) return;
+  }
+
+  client.pending += line;
+  client.pending += '\n';
+  linesOut++;
+}
+
+void broadcast(const std::string &id, const std::string &line)
+{
+  for(auto &client : clients) sendTo(client.second, id, line);
+}
+
+void expireHandle()
+{
+  for(auto kettle = kettles.begin(); kettle != kettles.end();) {
+    if(msSince(kettle->second.lastSeen) > KETTLETIMEOUT) {
+      broadcast(kettle->first, "LOST," + kettle->first);
+      kettle = kettles.erase(kettle);
+    }
+    else kettle++;
+  }
+
+  for(auto command = commands.begin(); command != commands.end();) {
+    if(msSince(command->second.sent) > COMMANDTIMEOUT) {
+      auto client = clients.find(command->second.client);
+      if(client != clients.end()) {
+        client->second.pending += "REPLY," + command->second.id + ",ERR," + std::to_string(command->first) + ",TIMEOUT\n";
+      }
+      command = commands.erase(command);
+    }
+    else command++;
+  }
+}
+
+void statsHandle()
+{
+  //  Delivery latency is measured at the client end, see "gateway" in src/bench
+  double seconds = STATSINTERVAL / 1000.0;
+  printf("kettles %zu | clients %zu | beacons/s %.1f | dropped %lu | lines/s %.1f\n",
+         kettles.size(), clients.size(), beaconsIn / seconds, beaconsDropped, linesOut / seconds);
+  fflush(stdout);
+
+  beaconsIn = 0;
+  linesOut = 0;
+  beaconsDropped = 0;
+}
+
+/**
+ * @brief Sends beacons for count fake kettles, spread evenly over each
+ * BEACONINTERVAL the way a room of real kettles would be
+ */
+int runSimulation(int count)
+{
+  int fd = beaconSocket(0);
+  if(fd < 0) return 1;
+
+  sockaddr_in group = {};
+  group.sin_family = AF_INET;
+  group.sin_port = htons(BEACONPORT);
+  group.sin_addr.s_addr = inet_addr(BEACONGROUP);
+
+  const char *states[] = {"IDLE", "HEATING", "POST_HEAT"};
+  std::vector<float> temperatures(count, 20.0f);
+  uint64_t sequence = 0;
+  std::mt19937 random(count);
+
+  printf("Simulating %d kettles\n", count);
+
+  auto gap = std::chrono::microseconds(BEACONINTERVAL * 1000 / count);
+  Clock::time_point next = Clock::now();
+
+  while(true) {
+    for(int i = 0; i < count; i++) {
+      temperatures[i] += ((int)(random() % 21) - 10) / 10.0f;
+      temperatures[i] = std::min(100.0f, std::max(15.0f, temperatures[i]));
+
+      char beacon[MAXPACKET];
+      int length = snprintf(beacon, sizeof(beacon), "STATUS,sim-%04d,%s,%.1f,40.0,main,0,%d,0,0,%llu",
+                            i, states[i % 3], temperatures[i], i % 3 == 1 ? 2200 : 0, (unsigned long long)++sequence);
+      if(kettleKeyLoaded) {
+        char mac[HMACHEXSIZE + 1];
+        hmacHex(kettleKey, beacon, length, mac);
+        length += snprintf(beacon + length, sizeof(beacon) - length, "|%s", mac);
+      }
+      sendto(fd, beacon, length, 0, (sockaddr*)&group, sizeof(group));
+
+      next += gap;
+      std::this_thread::sleep_until(next);
+    }
+  }
+}
+
+long msSince(Clock::time_point since)
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - since).count();
+}
@@ -0,0 +1,228 @@
+#include <unity.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <PowerSchedule.h>
+
+static PeerTable table;
+static uint64_t sequence = 0;
+
+//  Hears a beacon from a peer on the circuit at time now
+static void hear(const char* id, const char* state, unsigned int watts, unsigned int seconds,
+                 unsigned long now, unsigned int cap = 4600, int priority = 0)
+{
+  Beacon beacon = {};
+  strcpy(beacon.id, id);
+  strcpy(beacon.state, state);
+  strcpy(beacon.circuit, "main");
+  beacon.cap = cap;
+  beacon.watts = watts;
+  beacon.priority = priority;
+  beacon.secondsToTarget = seconds;
+  beacon.sequence = ++sequence;
+  peerUpdate(table, beacon, now);
+}
+
+static PowerDemand own(unsigned int seconds, unsigned int cap = 4600, int priority = 0)
+{
+  PowerDemand demand = {"kettle-m", cap, 2200, priority, seconds};
+  return demand;
+}
+
+void setUp()
+{
+  memset(&table, 0, sizeof(table));
+}
+
+void tearDown() {}
+
+void test_beacon_parse_reads_every_field()
+{
+  Beacon beacon;
+  TEST_ASSERT_TRUE(beaconParse("STATUS,kettle-abc123,QUEUED,21.5,95.0,kitchen,4600,2200,1,740,18446744073709551615", beacon));
+  TEST_ASSERT_EQUAL_STRING("kettle-abc123", beacon.id);
+  TEST_ASSERT_EQUAL_STRING("QUEUED", beacon.state);
+  TEST_ASSERT_EQUAL_STRING("kitchen", beacon.circuit);
+  TEST_ASSERT_EQUAL(4600, beacon.cap);
+  TEST_ASSERT_EQUAL(2200, beacon.watts);
+  TEST_ASSERT_EQUAL(1, beacon.priority);
+  TEST_ASSERT_EQUAL(740, beacon.secondsToTarget);
+  TEST_ASSERT_TRUE(beacon.sequence == UINT64_MAX);
+}
+
+void test_beacon_parse_rejects_old_and_bad_beacons()
+{
+  Beacon beacon;
+  TEST_ASSERT_FALSE(beaconParse("STATUS,kettle-abc123,QUEUED,21.5,95.0,2200,1,740", beacon));
+  TEST_ASSERT_FALSE(beaconParse("STATUS,kettle-abc123,QUEUED,21.5,95.0,kitchen,4600,2200,1,740", beacon));
+  TEST_ASSERT_FALSE(beaconParse("STATUS,k,IDLE,1.0,2.0,averyveryverylongcircuit,0,0,0,0,1", beacon));
+  TEST_ASSERT_FALSE(beaconParse("STATUS,k,IDLE,1.0,2.0,main,0,0,0,0,1,extra", beacon));
+  TEST_ASSERT_FALSE(beaconParse("STATUS,k,IDLE,1.0,2.0,main,0,0,0,0,-1", beacon));
+  TEST_ASSERT_FALSE(beaconParse("STATUS,k,IDLE,1.0,2.0,main,0,0,0,0,18446744073709551616", beacon));
+}
+
+void test_old_beacons_are_refused_even_after_the_peer_expires()
+{
+  hear("kettle-a", "HEATING", 2200, 100, 1000);
+  hear("kettle-b", "HEATING", 2200, 100, 1000);
+  TEST_ASSERT_FALSE(powerScheduled(table, own(300)));
+
+  //  A recording of kettle-a from before it started heating
+  Beacon replayed = {};
+  strcpy(replayed.id, "kettle-a");
+  strcpy(replayed.state, "IDLE");
+  strcpy(replayed.circuit, "main");
+  replayed.cap = 4600;
+  replayed.sequence = sequence - 1;
+  TEST_ASSERT_FALSE(peerUpdate(table, replayed, 2000));
+  TEST_ASSERT_FALSE(powerScheduled(table, own(300)));
+
+  //  Still refused once kettle-a has gone quiet and expired
+  peerExpire(table, 1000 + PEERTIMEOUT + 100001);
+  TEST_ASSERT_FALSE(table.peers[0].active);
+  TEST_ASSERT_FALSE(peerUpdate(table, replayed, 1000 + PEERTIMEOUT + 100002));
+  TEST_ASSERT_FALSE(table.peers[0].active);
+
+  replayed.sequence = sequence + 1;
+  TEST_ASSERT_TRUE(peerUpdate(table, replayed, 1000 + PEERTIMEOUT + 100003));
+  TEST_ASSERT_TRUE(table.peers[0].active);
+}
+
+void test_granted_when_the_cap_has_room()
+{
+  hear("kettle-a", "HEATING", 2200, 100, 1000);
+  TEST_ASSERT_TRUE(powerScheduled(table, own(300)));
+
+  hear("kettle-b", "HEATING", 2200, 100, 1000);
+  TEST_ASSERT_FALSE(powerScheduled(table, own(300)));
+}
+
+void test_waiting_kettles_go_by_priority_then_time_to_target()
+{
+  hear("kettle-a", "HEATING", 2200, 100, 1000);
+  hear("kettle-b", "QUEUED", 2200, 200, 1000);
+
+  //  kettle-b is nearer its target so goes first, filling the cap
+  TEST_ASSERT_FALSE(powerScheduled(table, own(300)));
+  TEST_ASSERT_TRUE(powerScheduled(table, own(150)));
+  TEST_ASSERT_TRUE(powerScheduled(table, own(300, 4600, 1)));
+}
+
+void test_every_kettle_reaches_the_same_schedule()
+{
+  //  kettle-m and kettle-b queued behind one heating kettle with the same time to
+  //  target, only one fits and both agree it is kettle-b by id
+  hear("kettle-a", "HEATING", 2200, 100, 1000);
+  hear("kettle-b", "QUEUED", 2200, 200, 1000);
+  bool ownGranted = powerScheduled(table, own(200));
+
+  memset(&table, 0, sizeof(table));
+  hear("kettle-a", "HEATING", 2200, 100, 1000);
+  hear("kettle-m", "QUEUED", 2200, 200, 1000);
+  PowerDemand peer = {"kettle-b", 4600, 2200, 0, 200};
+  bool peerGranted = powerScheduled(table, peer);
+
+  TEST_ASSERT_TRUE(ownGranted != peerGranted);
+  TEST_ASSERT_TRUE(peerGranted);
+}
+
+void test_lowest_cap_on_the_circuit_is_used()
+{
+  hear("kettle-a", "IDLE", 0, 0, 1000, 3000);
+  TEST_ASSERT_TRUE(powerScheduled(table, own(300)));
+
+  hear("kettle-b", "HEATING", 1500, 100, 1000);
+  TEST_ASSERT_FALSE(powerScheduled(table, own(300)));
+}
+
+void test_kettle_rated_above_the_cap_does_not_hold_up_the_rest()
+{
+  //  kettle-a is first in line but can never fit under the lowest cap heard
+  hear("kettle-a", "QUEUED", 3500, 10, 1000);
+  hear("kettle-b", "IDLE", 0, 0, 1000, 3000);
+  TEST_ASSERT_EQUAL(3000, circuitCap(table, 4600));
+  TEST_ASSERT_TRUE(powerScheduled(table, own(300)));
+
+  PowerDemand tooBig = {"kettle-m", 4600, 3500, 0, 300};
+  TEST_ASSERT_FALSE(powerScheduled(table, tooBig));
+}
+
+void test_full_peer_table_refuses_power_until_it_clears()
+{
+  char id[PEERIDSIZE];
+  for(int i = 0; i <= MAXPEERS; i++) {
+    sprintf(id, "kettle-%02d", i);
+    hear(id, "IDLE", 0, 0, 1000);
+  }
+  TEST_ASSERT_TRUE(table.overflow);
+  TEST_ASSERT_FALSE(powerScheduled(table, own(300)));
+
+  peerExpire(table, 1000 + PEERTIMEOUT + 1);
+  TEST_ASSERT_FALSE(table.overflow);
+  TEST_ASSERT_TRUE(powerScheduled(table, own(300)));
+}
+
+void test_new_kettle_takes_the_slot_expired_longest_ago()
+{
+  char id[PEERIDSIZE];
+  for(int i = 0; i < MAXPEERS; i++) {
+    sprintf(id, "kettle-%02d", i);
+    hear(id, "IDLE", 0, 0, i == 5 ? 500 : 1000);
+  }
+  peerExpire(table, 1000 + PEERTIMEOUT + 1);
+
+  hear("kettle-new", "IDLE", 0, 0, 1000 + PEERTIMEOUT + 2);
+  TEST_ASSERT_FALSE(table.overflow);
+  TEST_ASSERT_EQUAL_STRING("kettle-new", table.peers[5].id);
+  TEST_ASSERT_TRUE(table.peers[5].active);
+}
+
+void test_quiet_kettles_with_a_demand_are_kept_until_they_would_finish()
+{
+  hear("kettle-a", "IDLE", 0, 0, 1000);
+  hear("kettle-b", "HEATING", 2200, 100, 1000);
+  hear("kettle-c", "QUEUED", 2200, 50, 1000);
+
+  peerExpire(table, 1000 + PEERTIMEOUT + 1);
+  TEST_ASSERT_FALSE(table.peers[0].active);
+  TEST_ASSERT_TRUE(table.peers[1].active);
+  TEST_ASSERT_TRUE(table.peers[2].active);
+  TEST_ASSERT_FALSE(powerScheduled(table, own(300)));
+
+  peerExpire(table, 1000 + PEERTIMEOUT + 50001);
+  TEST_ASSERT_FALSE(table.peers[2].active);
+  TEST_ASSERT_TRUE(table.peers[1].active);
+
+  peerExpire(table, 1000 + PEERTIMEOUT + 100001);
+  TEST_ASSERT_FALSE(table.peers[1].active);
+  TEST_ASSERT_TRUE(powerScheduled(table, own(300)));
+}
+
+void test_expiry_survives_millis_wrapping()
+{
+  unsigned long nearWrap = 0UL - 1000;
+  hear("kettle-a", "IDLE", 0, 0, nearWrap);
+  peerExpire(table, nearWrap + PEERTIMEOUT);
+  TEST_ASSERT_TRUE(table.peers[0].active);
+  peerExpire(table, nearWrap + PEERTIMEOUT + 1);
+  TEST_ASSERT_FALSE(table.peers[0].active);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_beacon_parse_reads_every_field);
+  RUN_TEST(test_beacon_parse_rejects_old_and_bad_beacons);
+  RUN_TEST(test_old_beacons_are_refused_even_after_the_peer_expires);
+  RUN_TEST(test_granted_when_the_cap_has_room);
+  RUN_TEST(test_waiting_kettles_go_by_priority_then_time_to_target);
+  RUN_TEST(test_every_kettle_reaches_the_same_schedule);
+  RUN_TEST(test_lowest_cap_on_the_circuit_is_used);
+  RUN_TEST(test_kettle_rated_above_the_cap_does_not_hold_up_the_rest);
+  RUN_TEST(test_full_peer_table_refuses_power_until_it_clears);
+  RUN_TEST(test_new_kettle_takes_the_slot_expired_longest_ago);
+  RUN_TEST(test_quiet_kettles_with_a_demand_are_kept_until_they_would_finish);
+  RUN_TEST(test_expiry_survives_millis_wrapping);
+  return UNITY_END();
+}
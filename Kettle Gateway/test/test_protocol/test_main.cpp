@@ -0,0 +1,342 @@
+#include <unity.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <KettleProtocol.h>
+
+#define UDPMAXPACKET            200
+
+static uint8_t key[HMACSIZE];
+
+//  Builds "<body>|<hmac>" signed with key
+static void sign(const char* body, char* packet)
+{
+  char mac[HMACHEXSIZE + 1];
+  hmacHex(key, body, strlen(body), mac);
+  strcpy(packet, body);
+  strcat(packet, "|");
+  strcat(packet, mac);
+}
+
+void setUp()
+{
+  for(int i = 0; i < HMACSIZE; i++) key[i] = i;
+}
+
+void tearDown() {}
+
+void test_sha256_matches_standard_vector()
+{
+  uint8_t digest[32];
+  sha256((const uint8_t*)"abc", 3, digest);
+
+  const uint8_t expected[32] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+  };
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, digest, 32);
+}
+
+void test_hmac_matches_rfc4231_case_2()
+{
+  uint8_t mac[HMACSIZE];
+  const char* message = "what do ya want for nothing?";
+  hmacSha256((const uint8_t*)"Jefe", 4, (const uint8_t*)message, strlen(message), mac);
+
+  const uint8_t expected[HMACSIZE] = {
+    0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+    0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43
+  };
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, mac, HMACSIZE);
+}
+
+void test_hmac_hex_matches_only_the_same_message_and_key()
+{
+  char mac[HMACHEXSIZE + 1];
+  hmacHex(key, "1:SWITCH", 8, mac);
+  TEST_ASSERT_EQUAL(HMACHEXSIZE, strlen(mac));
+  TEST_ASSERT_TRUE(hmacMatches(key, "1:SWITCH", 8, mac));
+  TEST_ASSERT_FALSE(hmacMatches(key, "2:SWITCH", 8, mac));
+
+  mac[10] = mac[10] == '0' ? '1' : '0';
+  TEST_ASSERT_FALSE(hmacMatches(key, "1:SWITCH", 8, mac));
+
+  mac[HMACHEXSIZE - 1] = '\0';
+  TEST_ASSERT_FALSE(hmacMatches(key, "1:SWITCH", 8, mac));
+
+  key[0] ^= 1;
+  hmacHex(key, "1:SWITCH", 8, mac);
+  key[0] ^= 1;
+  TEST_ASSERT_FALSE(hmacMatches(key, "1:SWITCH", 8, mac));
+}
+
+void test_hex_to_bytes_needs_exact_length()
+{
+  uint8_t bytes[2];
+  TEST_ASSERT_TRUE(hexToBytes("a1FF", bytes, 2));
+  TEST_ASSERT_EQUAL_HEX8(0xa1, bytes[0]);
+  TEST_ASSERT_EQUAL_HEX8(0xff, bytes[1]);
+  TEST_ASSERT_FALSE(hexToBytes("a1F", bytes, 2));
+  TEST_ASSERT_FALSE(hexToBytes("a1FF0", bytes, 2));
+  TEST_ASSERT_FALSE(hexToBytes("a1xF", bytes, 2));
+}
+
+void test_request_id_length()
+{
+  TEST_ASSERT_EQUAL(1, requestIdLength("7:SWITCH"));
+  TEST_ASSERT_EQUAL(13, requestIdLength("1700000000000:SWITCH"));
+  TEST_ASSERT_EQUAL(20, requestIdLength("18446744073709551615:SWITCH"));
+  TEST_ASSERT_EQUAL(0, requestIdLength("184467440737095516150:SWITCH"));
+  TEST_ASSERT_EQUAL(0, requestIdLength("SWITCH"));
+  TEST_ASSERT_EQUAL(0, requestIdLength(":SWITCH"));
+  TEST_ASSERT_EQUAL(0, requestIdLength("12SWITCH"));
+  TEST_ASSERT_EQUAL(0, requestIdLength("Connect Mon Oct 19 2026 10:00:00"));
+}
+
+void test_parse_counter_rejects_overflow()
+{
+  uint64_t counter;
+  TEST_ASSERT_TRUE(parseCounter("18446744073709551615", 20, counter));
+  TEST_ASSERT_TRUE(counter == UINT64_MAX);
+  TEST_ASSERT_FALSE(parseCounter("18446744073709551616", 20, counter));
+  TEST_ASSERT_FALSE(parseCounter("99999999999999999999", 20, counter));
+}
+
+void test_udp_verify_accepts_signed_timestamp_counter()
+{
+  char packet[160];
+  sign("1700000000000:SWITCH", packet);
+
+  uint64_t counter;
+  TEST_ASSERT_EQUAL(UDP_ACCEPT, udpVerify(packet, key, 0, counter));
+  TEST_ASSERT_TRUE(counter == 1700000000000ULL);
+  TEST_ASSERT_EQUAL_STRING("1700000000000:SWITCH", packet);
+}
+
+void test_udp_verify_rejects_unsigned_and_forged()
+{
+  char packet[160] = "5:SWITCH";
+  uint64_t counter;
+  TEST_ASSERT_EQUAL(UDP_UNSIGNED, udpVerify(packet, key, 0, counter));
+
+  sign("5:SWITCH", packet);
+  packet[0] = '6';
+  TEST_ASSERT_EQUAL(UDP_FORGED, udpVerify(packet, key, 0, counter));
+
+  strcpy(packet, "5:SWITCH|nothex");
+  TEST_ASSERT_EQUAL(UDP_FORGED, udpVerify(packet, key, 0, counter));
+}
+
+void test_udp_verify_rejects_replays()
+{
+  char packet[160];
+  uint64_t counter;
+
+  sign("41:SWITCH", packet);
+  TEST_ASSERT_EQUAL(UDP_REPLAY, udpVerify(packet, key, 41, counter));
+  TEST_ASSERT_TRUE(counter == 41);
+
+  sign("40:SWITCH", packet);
+  TEST_ASSERT_EQUAL(UDP_REPLAY, udpVerify(packet, key, 41, counter));
+
+  sign("42:SWITCH", packet);
+  TEST_ASSERT_EQUAL(UDP_ACCEPT, udpVerify(packet, key, 41, counter));
+}
+
+void test_udp_verify_reports_signed_but_malformed()
+{
+  char packet[160];
+  uint64_t counter;
+
+  sign("SWITCH", packet);
+  TEST_ASSERT_EQUAL(UDP_MALFORMED, udpVerify(packet, key, 0, counter));
+
+  sign("99999999999999999999:SWITCH", packet);
+  TEST_ASSERT_EQUAL(UDP_MALFORMED, udpVerify(packet, key, 0, counter));
+
+  sign("184467440737095516150:SWITCH", packet);
+  TEST_ASSERT_EQUAL(UDP_MALFORMED, udpVerify(packet, key, 0, counter));
+}
+
+void test_udp_reply_only_for_rejected_commands()
+{
+  char reply[UDPREPLYSIZE + 1];
+
+  TEST_ASSERT_TRUE(udpReply(UDP_MALFORMED, 0, 7, reply));
+  TEST_ASSERT_EQUAL_STRING("ERR,0,INVALID", reply);
+
+  TEST_ASSERT_TRUE(udpReply(UDP_REPLAY, 0, 0, reply));
+  TEST_ASSERT_EQUAL_STRING("ERR,0,REPLAY,0", reply);
+
+  TEST_ASSERT_TRUE(udpReply(UDP_REPLAY, UINT64_MAX, UINT64_MAX, reply));
+  TEST_ASSERT_EQUAL_STRING("ERR,18446744073709551615,REPLAY,18446744073709551615", reply);
+  TEST_ASSERT_EQUAL(UDPREPLYSIZE, strlen(reply));
+
+  TEST_ASSERT_FALSE(udpReply(UDP_ACCEPT, 8, 7, reply));
+  TEST_ASSERT_FALSE(udpReply(UDP_UNSIGNED, 0, 7, reply));
+  TEST_ASSERT_FALSE(udpReply(UDP_FORGED, 0, 7, reply));
+}
+
+//  UDP socket on 127.0.0.1 at a free port, address is set to where it listens
+static int loopbackSocket(sockaddr_in &address)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  bind(fd, (sockaddr*)&address, sizeof(address));
+  getsockname(fd, (sockaddr*)&address, &length);
+
+  timeval timeout = {0, 200000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+//  Answers one packet the way the firmware's control port does, accepted commands get a bare ACK
+static void controlAnswer(int fd, CounterWindow &window)
+{
+  char packet[UDPMAXPACKET + 1];
+  sockaddr_in from;
+  socklen_t fromLength = sizeof(from);
+  ssize_t length = recvfrom(fd, packet, UDPMAXPACKET, 0, (sockaddr*)&from, &fromLength);
+  if(length <= 0) return;
+  packet[length] = '\0';
+
+  uint64_t counter;
+  UdpVerdict verdict = udpVerify(packet, key, window.last, counter);
+  if(verdict == UDP_UNSIGNED || verdict == UDP_FORGED) return;
+
+  char reply[UDPREPLYSIZE + 1];
+  if(!udpReply(verdict, counter, window.last, reply)) {
+    counterAccept(window, counter);
+    snprintf(reply, sizeof(reply), "ACK,%llu", (unsigned long long)counter);
+  }
+
+  char signedReply[UDPREPLYSIZE + HMACHEXSIZE + 2];
+  sign(reply, signedReply);
+  sendto(fd, signedReply, strlen(signedReply), 0, (sockaddr*)&from, fromLength);
+}
+
+/**
+ * @brief Sends packet from client to the kettle socket and reads the signed reply
+ * @param reply set to the reply without its signature, empty when none came back
+ */
+static void exchange(int client, int kettle, const sockaddr_in &kettleAddress, CounterWindow &window,
+                     const char* packet, char* reply)
+{
+  sendto(client, packet, strlen(packet), 0, (const sockaddr*)&kettleAddress, sizeof(kettleAddress));
+  controlAnswer(kettle, window);
+
+  reply[0] = '\0';
+  char received[UDPMAXPACKET + 1];
+  ssize_t length = recv(client, received, UDPMAXPACKET, 0);
+  if(length <= 0) return;
+  received[length] = '\0';
+
+  char* mac = strrchr(received, '|');
+  TEST_ASSERT_TRUE(mac != NULL);
+  *mac = '\0';
+  TEST_ASSERT_TRUE(hmacMatches(key, received, strlen(received), mac + 1));
+  strcpy(reply, received);
+}
+
+void test_udp_commands_over_loopback()
+{
+  sockaddr_in kettleAddress, clientAddress;
+  int kettle = loopbackSocket(kettleAddress);
+  int client = loopbackSocket(clientAddress);
+  CounterWindow window = {0, 0};
+  char packet[UDPMAXPACKET + 1];
+  char reply[UDPMAXPACKET + 1];
+
+  sign("5:SWITCH", packet);
+  exchange(client, kettle, kettleAddress, window, packet, reply);
+  TEST_ASSERT_EQUAL_STRING("ACK,5", reply);
+
+  exchange(client, kettle, kettleAddress, window, packet, reply);
+  TEST_ASSERT_EQUAL_STRING("ERR,5,REPLAY,5", reply);
+
+  sign("SWITCH", packet);
+  exchange(client, kettle, kettleAddress, window, packet, reply);
+  TEST_ASSERT_EQUAL_STRING("ERR,0,INVALID", reply);
+
+  sign("6:SWITCH", packet);
+  packet[0] = '7';
+  exchange(client, kettle, kettleAddress, window, packet, reply);
+  TEST_ASSERT_EQUAL_STRING("", reply);
+
+  sign("18446744073709551615:SWITCH", packet);
+  exchange(client, kettle, kettleAddress, window, packet, reply);
+  TEST_ASSERT_EQUAL_STRING("ACK,18446744073709551615", reply);
+
+  sign("6:SWITCH", packet);
+  exchange(client, kettle, kettleAddress, window, packet, reply);
+  TEST_ASSERT_EQUAL_STRING("ERR,6,REPLAY,18446744073709551615", reply);
+
+  close(client);
+  close(kettle);
+}
+
+void test_counter_window_reserves_in_blocks()
+{
+  CounterWindow window = {0, 0};
+
+  TEST_ASSERT_TRUE(counterAccept(window, 1));
+  TEST_ASSERT_TRUE(window.reserved == 1 + COUNTERBLOCK);
+
+  for(uint64_t counter = 2; counter < 1000; counter++) TEST_ASSERT_FALSE(counterAccept(window, counter));
+  TEST_ASSERT_TRUE(window.last == 999);
+
+  TEST_ASSERT_TRUE(counterAccept(window, 1 + COUNTERBLOCK));
+  TEST_ASSERT_TRUE(window.reserved == 1 + 2 * COUNTERBLOCK);
+
+  TEST_ASSERT_TRUE(counterAccept(window, UINT64_MAX - 1));
+  TEST_ASSERT_TRUE(window.reserved == UINT64_MAX);
+}
+
+void test_counters_before_reservation_are_rejected_after_reboot()
+{
+  CounterWindow window = {0, 0};
+  counterAccept(window, 1700000000000ULL);
+  counterAccept(window, 1700000000500ULL);
+
+  //  Only the reservation survives a reboot
+  CounterWindow rebooted = {window.reserved, window.reserved};
+
+  char packet[160];
+  uint64_t counter;
+  sign("1700000000600:SWITCH", packet);
+  TEST_ASSERT_EQUAL(UDP_REPLAY, udpVerify(packet, key, rebooted.last, counter));
+
+  char body[40];
+  snprintf(body, sizeof(body), "%llu:SWITCH", (unsigned long long)(window.reserved + 1));
+  sign(body, packet);
+  TEST_ASSERT_EQUAL(UDP_ACCEPT, udpVerify(packet, key, rebooted.last, counter));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_sha256_matches_standard_vector);
+  RUN_TEST(test_hmac_matches_rfc4231_case_2);
+  RUN_TEST(test_hmac_hex_matches_only_the_same_message_and_key);
+  RUN_TEST(test_hex_to_bytes_needs_exact_length);
+  RUN_TEST(test_request_id_length);
+  RUN_TEST(test_parse_counter_rejects_overflow);
+  RUN_TEST(test_udp_verify_accepts_signed_timestamp_counter);
+  RUN_TEST(test_udp_verify_rejects_unsigned_and_forged);
+  RUN_TEST(test_udp_verify_rejects_replays);
+  RUN_TEST(test_udp_verify_reports_signed_but_malformed);
+  RUN_TEST(test_udp_reply_only_for_rejected_commands);
+  RUN_TEST(test_udp_commands_over_loopback);
+  RUN_TEST(test_counter_window_reserves_in_blocks);
+  RUN_TEST(test_counters_before_reservation_are_rejected_after_reboot);
+  return UNITY_END();
+}